@@ -35,6 +35,7 @@ llvmNo86BuildType = 'Release'
 llvmBrowserBuildType = 'Release'
 fastcompBuildType = 'RelWithDebInfo'
 binaryenBuildType = 'RelWithDebInfo'
+binaryenBrowserBuildType = 'Release'
 optimizerBuildType = 'RelWithDebInfo'
 browserClangFormatBuildType = 'Release'
 browserClangBuildType = 'Release'
@@ -52,10 +53,12 @@ fastcompBuild = root + 'build/fastcomp-' + fastcompBuildType + '/'
 fastcompInstall = root + 'install/fastcomp-' + fastcompBuildType + '/'
 binaryenBuild = root + 'build/binaryen-' + binaryenBuildType + '/'
 binaryenInstall = root + 'install/binaryen-' + binaryenBuildType + '/'
+binaryenBrowserBuild = root + 'build/binaryen-browser-' + binaryenBrowserBuildType + '/'
 wabtInstall = root + 'repos/wabt/bin/'
 optimizerBuild = root + 'build/optimizer-' + optimizerBuildType + '/'
 rtlBuildDir = root + 'build/rtl/'
 rtlEosBuildDir = root + 'build/rtl-eos/'
+rtlEosBcBuildDir = root + 'build/rtl-eos-bc/'
 browserClangFormatBuild = root + 'build/clang-format-browser-' + browserClangFormatBuildType + '/'
 browserClangBuild = root + 'build/clang-browser-' + browserClangBuildType + '/'
 browserClangEosBuild = root + 'build/clang-eos-browser-' + browserClangBuildType + '/'
@@ -342,7 +345,7 @@ def tools():
             ' cmake -G "Ninja"' +
             ' -DCMAKE_BUILD_TYPE=Debug' +
             ' ../../src')
-    run('cd build/tools && ninja cib-link cib-ar combine-data')
+    run('cd build/tools && ninja cib-link cib-ar cib-client combine-data wasm-tools-test')
 
 def llvmBrowser():
     if not os.path.isdir(llvmBrowserBuild):
@@ -372,6 +375,16 @@ def llvmBrowser():
             ' ' + root + 'repos/llvm')
     run('cd ' + llvmBrowserBuild + ' && time -p ninja ' + ' '.join(llvmBrowserTargets))
 
+def binaryenBrowser():
+    if not os.path.isdir(binaryenBrowserBuild):
+        run('mkdir -p ' + binaryenBrowserBuild)
+        run('cd ' + binaryenBrowserBuild + ' && ' +
+            'time -p emcmake cmake -G "Ninja"' +
+            ' -DCMAKE_BUILD_TYPE=' + binaryenBrowserBuildType +
+            ' -DBUILD_STATIC_LIB=ON' +
+            ' ' + root + 'repos/binaryen')
+    run('cd ' + binaryenBrowserBuild + ' && time -p ninja binaryen')
+
 def node():
     download('https://nodejs.org/dist/v8.11.1/node-v8.11.1-linux-x64.tar.xz')
     if not os.path.exists('build/node-v8.11.1-linux-x64'):
@@ -406,11 +419,6 @@ def dist():
     run('cp -au download/golden-layout-1.5.9/src/css/goldenlayout-light-theme.css dist/golden-layout')
     run('cp -au download/golden-layout-1.5.9/dist/goldenlayout.min.js dist/golden-layout')
 
-    run('mkdir -p dist/zip.js')
-    run('cp -au repos/zip.js/WebContent/inflate.js dist/zip.js')
-    run('cp -au repos/zip.js/WebContent/zip.js dist/zip.js')
-    run('cp -au repos/binaryen/bin/binaryen.js dist/binaryen.js')
-    run('cp -au repos/binaryen/bin/binaryen.wasm dist/binaryen.wasm')
     run('cp -au repos/binaryen/LICENSE dist/binaryen-LICENSE')
 
     if not os.path.exists('repos/eos-altjs/node_modules'):
@@ -452,6 +460,20 @@ def rtlEos():
     run('cd ' + rtlEosBuildDir + ' && ninja')
     #run('cd ' + rtlEosBuildDir + ' && ninja -v -j1 2>&1 | tee ../../x.txt')
 
+# rtl-eos as bitcode, for clang-eos --lto
+def rtlEosBc():
+    boost()
+    if not os.path.isdir(rtlEosBcBuildDir):
+        run('mkdir -p ' + rtlEosBcBuildDir)
+        run('cd ' + rtlEosBcBuildDir + ' &&' +
+            ' cmake -G "Ninja"' +
+            ' -DLLVM_INSTALL=' + llvmBuild +
+            ' -DCMAKE_C_COMPILER=' + llvmBuild + 'bin/clang' +
+            ' -DCMAKE_CXX_COMPILER=' + llvmBuild + 'bin/clang++' +
+            ' -DCIB_BITCODE=on' +
+            ' ../../src/rtl-eos')
+    run('cd ' + rtlEosBcBuildDir + ' && ninja')
+
 def app(name, buildType, buildDir, prepBuildDir=None, env=''):
     if not os.path.isdir(buildDir):
         run('mkdir -p ' + buildDir)
@@ -459,6 +481,7 @@ def app(name, buildType, buildDir, prepBuildDir=None, env=''):
             ' emcmake cmake -G "Ninja"' +
             ' -DCMAKE_BUILD_TYPE=' + buildType +
             ' -DLLVM_BUILD=' + llvmBrowserBuild +
+            ' -DBINARYEN_BUILD=' + binaryenBrowserBuild +
             ' -DEMSCRIPTEN=on'
             ' ../../src')
     if prepBuildDir:
@@ -467,6 +490,35 @@ def app(name, buildType, buildDir, prepBuildDir=None, env=''):
     if not os.path.isdir('dist'):
         run('mkdir -p dist')
 
+# Precompile each header set in src/pch/<app>/ with the native build of <app>.
+# The native and browser builds share the sysroot layout and the PCHs are
+# relocatable, so the browser builds ship these in their preload image.
+def pch(app, buildDir, build):
+    llvmNo86()
+    build()
+    run('mkdir -p build/pch/' + app)
+    for header in sorted(os.listdir('src/pch/' + app)):
+        if header.endswith('.h'):
+            run('cp -au src/pch/' + app + '/' + header + ' build/pch/' + app)
+            run(buildDir + app + ' --pch src/pch/' + app + '/' + header + ' build/pch/' + app + '/' + header[:-2] + '.pch')
+
+def pchClang():
+    pch('clang', 'build/apps-native/', appClangNative)
+
+def pchClangEos():
+    pch('clang-eos', 'build/apps-eos-native/', appClangEosNative)
+
+def copyPch(app, buildDir):
+    if os.path.isdir('build/pch/' + app):
+        run('mkdir -p ' + buildDir + 'usr/pch')
+        run('cp -au build/pch/' + app + '/. ' + buildDir + 'usr/pch')
+
+# The browser builds mount their sysroot (usr/, LIB_PREFIX) from a zip instead
+# of preloading it; clang-zip.cpp's ZipFileSystem inflates each header on first use.
+def packSysroot(name, buildDir):
+    run('cd ' + buildDir + ' && rm -f ' + name + '-sysroot.zip')
+    run('cd ' + buildDir + 'usr && zip -qrXD9 ../' + name + '-sysroot.zip .')
+
 def appClangFormat():
     app('clang-format', browserClangFormatBuildType, browserClangFormatBuild)
     run('cp -au ' + browserClangFormatBuild + 'clang-format.js ' + browserClangFormatBuild + 'clang-format.wasm dist')
@@ -477,15 +529,19 @@ def appClang():
         run('cp -auv repos/emscripten/system/include ' + browserClangBuild + 'usr')
         run('cp -auv repos/emscripten/system/lib/libcxxabi/include ' + browserClangBuild + 'usr/lib/libcxxabi')
         run('cp -auv repos/emscripten/system/lib/libc/musl/arch/emscripten ' + browserClangBuild + 'usr/lib/libc/musl/arch')
+        run('mkdir -p ' + browserClangBuild + 'usr/src/rtl')
+        run('cp -au src/rtl/extern-templates.h ' + browserClangBuild + 'usr/src/rtl')
+        copyPch('clang', browserClangBuild)
         if includeBoost:
             boost()
             run('cp -auv download/boost_1_66_0/boost ' + browserClangBuild + 'usr/include')
     app('clang', browserClangBuildType, browserClangBuild, prepBuildDir)
+    packSysroot('clang', browserClangBuild)
     if(reoptClang):
         run('cd ' + browserClangBuild + ' && wasm-opt -Os clang.wasm -o clang-opt.wasm')
     else:
         run('cd ' + browserClangBuild + ' && cp clang.wasm clang-opt.wasm')
-    run('cp -au ' + browserClangBuild + 'clang.js ' + browserClangBuild + 'clang.data dist')
+    run('cp -au ' + browserClangBuild + 'clang.js ' + browserClangBuild + 'clang-sysroot.zip dist')
     run('cp -au ' + browserClangBuild + 'clang-opt.wasm dist/clang.wasm')
 
 def appClangNative():
@@ -493,7 +549,8 @@ def appClangNative():
         run('mkdir -p build/apps-native')
         run('cd build/apps-native &&' +
             ' CXX=' + llvmInstall + 'bin/clang++' +
-            ' CXXFLAGS=-DLIB_PREFIX=' + root + 'repos/emscripten/system/' +
+            ' CXXFLAGS="-DLIB_PREFIX=' + root + 'repos/emscripten/system/ -DPCH_DIR=' + root + 'build/pch/clang/' +
+            ' -DEXTERN_TEMPLATES=' + root + 'src/rtl/extern-templates.h"' +
             ' cmake -G "Ninja"' +
             ' -DCMAKE_BUILD_TYPE=Debug' +
             ' -DLLVM_BUILD=' + llvmNo86Build +
@@ -516,6 +573,7 @@ def appClangEos():
         copy('repos/emscripten/system/lib/libcxxabi/include')
         copy('src/rtl-eos/eosiolib')
         copy('src/rtl-eos/libc')
+        run('cp -au src/rtl-eos/extern-templates.h ' + browserClangEosBuild + 'usr/src/rtl-eos')
         copy('repos/eos-libcxx/include/support/musl')
         copy('repos/eos-musl/include')
         copy('repos/eos-musl/arch/eos')
@@ -524,23 +582,88 @@ def appClangEos():
         run("cd " + browserClangEosBuild + " && mv boost_staging/boost usr/download/boost_1_66_0")
         copy('repos/magic-get/include')
         run('cp build/rtl-eos/rtl-eos ' + browserClangEosBuild + 'usr/build/rtl-eos/rtl-eos')
+        if os.path.exists('build/rtl-eos-bc/rtl-eos'):
+            run("mkdir -p " + browserClangEosBuild + "usr/build/rtl-eos-bc")
+            run('cp build/rtl-eos-bc/rtl-eos ' + browserClangEosBuild + 'usr/build/rtl-eos-bc/rtl-eos')
+        copyPch('clang-eos', browserClangEosBuild)
     app('clang-eos', browserClangBuildType, browserClangEosBuild, prepBuildDir)
+    packSysroot('clang-eos', browserClangEosBuild)
     if(reoptClang):
         run('cd ' + browserClangEosBuild + ' && wasm-opt -Os clang-eos.wasm -o clang-eos-opt.wasm')
     else:
         run('cd ' + browserClangEosBuild + ' && cp clang-eos.wasm clang-eos-opt.wasm')
-    run('cp -au ' + browserClangEosBuild + 'clang-eos.js ' + browserClangEosBuild + 'clang-eos.data dist')
+    run('cp -au ' + browserClangEosBuild + 'clang-eos.js ' + browserClangEosBuild + 'clang-eos-sysroot.zip dist')
     run('cp -au ' + browserClangEosBuild + 'clang-eos-opt.wasm dist/clang-eos.wasm')
 
+# Runs the browser build under node until it's ready to compile, then saves
+# its memory as <name>-snapshot.wasm's data segments (see src/snapshot.js).
+# dist gets the snapshot in place of the plain build; the sysroot is inside.
+def snapshot(name, buildDir):
+    run('node src/snapshot.js ' + buildDir + name + '.js ' + buildDir + name + '-opt.wasm ' +
+        buildDir + name + '-sysroot.zip ' + buildDir + name + '-snapshot.wasm')
+    run('cp -au ' + buildDir + name + '-snapshot.wasm dist/' + name + '.wasm')
+
+def snapshotClang():
+    snapshot('clang', browserClangBuild)
+
+def snapshotClangEos():
+    snapshot('clang-eos', browserClangEosBuild)
+
+# Compiles say-hello.cpp 500 times with the browser build of clang under node
+# and fails if its heap keeps growing (see src/memory-stress.js)
+def memoryStress():
+    run('node src/memory-stress.js ' + browserClangBuild + 'clang.js ' + browserClangBuild + 'clang-opt.wasm ' +
+        browserClangBuild + 'clang-sysroot.zip src/say-hello.cpp 500')
+
+# Compiles every .cpp under a directory with a native build, tracing every
+# template instantiation, then tallies them with src/template-stats.js. What
+# most sources instantiate belongs in src/rtl/extern-templates.h or
+# src/rtl-eos/extern-templates.h.
+def templateStats(corpus, app, buildDir, outputs):
+    run('rm -rf build/template-stats && mkdir -p build/template-stats')
+    n = 0
+    for dir, dirs, files in os.walk(corpus):
+        for f in sorted(files):
+            if f.endswith('.cpp'):
+                out = 'build/template-stats/' + str(n)
+                run(buildDir + app + ' --time-trace ' + out + '.json --time-trace-granularity 0 ' +
+                    os.path.join(dir, f) + ''.join(' ' + out + o for o in outputs))
+                n += 1
+    run('node src/template-stats.js build/template-stats/*.json')
+
+def templateStatsClang():
+    appClangNative()
+    templateStats(getattr(args, 'template-stats'), 'clang', 'build/apps-native/', ['.wasm'])
+
+def templateStatsClangEos():
+    appClangEosNative()
+    templateStats(getattr(args, 'template-stats-eos'), 'clang-eos', 'build/apps-eos-native/', ['-prelinked.wasm', '.wasm'])
+
+# Runs the native checks of the linker (src/test/wasm-tools-test.cpp)
+def test():
+    tools()
+    run('cd build/tools && ctest --output-on-failure')
+
+# Compiles src/test/extern-templates.cpp with the native build of app 2, with
+# src/test/extern-templates.h in place of rtl's extern-templates.h. The
+# compile fails if ExternTemplatesPlugin enters the header in the wrong place
+# or the wrong number of times.
+def testExternTemplates():
+    appClangNative()
+    run('mkdir -p build/test')
+    run('CIB_EXTERN_TEMPLATES=' + root + 'src/test/extern-templates.h build/apps-native/clang' +
+        ' src/test/extern-templates.cpp build/test/extern-templates.wasm')
+
 def appClangEosNative():
     if not os.path.isdir('build/apps-eos-native'):
         run('mkdir -p build/apps-eos-native')
         run('cd build/apps-eos-native &&' +
             ' CXX=' + llvmInstall + 'bin/clang++' +
-            ' CXXFLAGS="-DLIB_PREFIX=' + root + ' -DEOS_CLANG"' +
+            ' CXXFLAGS="-DLIB_PREFIX=' + root + ' -DPCH_DIR=' + root + 'build/pch/clang-eos/ -DEOS_CLANG"' +
             ' cmake -G "Ninja"' +
             ' -DCMAKE_BUILD_TYPE=Debug' +
             ' -DLLVM_BUILD=' + llvmNo86Build +
+            ' -DBINARYEN_BUILD=' + binaryenBuild +
             ' -DCMAKE_CXX_STANDARD_LIBRARIES="-lpthread -lncurses -ltinfo -lz"' +
             ' ../../src')
     run('cd build/apps-eos-native && time -p ninja -v clang-eos')
@@ -554,25 +677,26 @@ def http():
     run('mkdir -p build/http')
     run('cd build/http && ln -sf ' +
         browserClangFormatBuild + 'clang-format.* ' +
-        browserClangBuild + 'clang.data ' +
+        browserClangBuild + 'clang-sysroot.zip ' +
         browserClangBuild + 'clang.js ' +
-        browserClangEosBuild + 'clang-eos.data ' +
+        browserClangEosBuild + 'clang-eos-sysroot.zip ' +
         browserClangEosBuild + 'clang-eos.js ' +
         browserRuntimeBuild + 'runtime.* ' +
         '../../dist/monaco-editor ' +
         '../../dist/golden-layout ' +
         '../../dist/jquery-1.11.1.min.js ' +
         '../../dist/zip.js ' +
-        '../../dist/binaryen.js ' +
-        '../../dist/binaryen.wasm ' +
         '../../dist/eos-altjs-rel.js ' +
         '../../src/clang.html ' +
         '../../src/eos.html ' +
         '../../src/process*.js ' +
         '../../src/wasm-tools.js ' +
         '.')
-    run('cd build/http && ln -sf ' + browserClangBuild + 'clang-opt.wasm clang.wasm')
-    run('cd build/http && ln -sf ' + browserClangEosBuild + 'clang-eos-opt.wasm clang-eos.wasm')
+    for (name, buildDir) in [('clang', browserClangBuild), ('clang-eos', browserClangEosBuild)]:
+        wasm = name + '-opt.wasm'
+        if os.path.exists(buildDir + name + '-snapshot.wasm'):
+            wasm = name + '-snapshot.wasm'
+        run('cd build/http && ln -sf ' + buildDir + wasm + ' ' + name + '.wasm')
     try:
         if 'HTTP_SERVER' in os.environ:
             run('cd build/http && ' + os.environ['HTTP_SERVER'])
@@ -601,15 +725,26 @@ commands = [
     ('e', 'emscripten',     emscripten,         'store_true',   True,           True,           "Prepare emscripten by compiling say-hello.cpp"),
     ('t', 'tools',          tools,              'store_true',   True,           True,           "Build tools if not already built"),
     ('b', 'llvm-browser',   llvmBrowser,        'store_true',   True,           True,           "Build llvm in-browser components"),
+    ('',  'binaryen-browser', binaryenBrowser,  'store_true',   False,          True,           "Build binaryen in-browser library"),
     ('d', 'dist',           dist,               'store_true',   True,           True,           "Fill dist/"),
     ('r', 'rtl',            rtl,                'store_true',   True,           False,          "Build RTL"),
     ('R', 'rtl-eos',        rtlEos,             'store_true',   False,          True,           "Build RTL-EOS"),
+    ('',  'rtl-eos-bc',     rtlEosBc,           'store_true',   False,          True,           "Build RTL-EOS as bitcode (for --lto)"),
+    ('',  'pch',            pchClang,           'store_true',   True,           False,          "Build precompiled headers for clang"),
+    ('',  'pch-eos',        pchClangEos,        'store_true',   False,          True,           "Build precompiled headers for clang-eos"),
     ('1', 'app-1',          appClangFormat,     'store_true',   True,           False,          "Build app 1: clang-format"),
     ('2', 'app-2',          appClang,           'store_true',   True,           False,          "Build app 2: clang"),
     ('n', 'app-n',          appClangNative,     'store_true',   False,          False,          "Build app 2: clang, native"),
     ('3', 'app-3',          appRuntime,         'store_true',   True,           False,          "Build app 3: runtime"),
     ('4', 'app-4',          appClangEos,        'store_true',   False,          True,           "Build app 4: clang-eos"),
     ('N', 'app-N',          appClangEosNative,  'store_true',   False,          False,          "Build app 4: clang-eos, native"),
+    ('',  'snapshot',       snapshotClang,      'store_true',   True,           False,          "Snapshot app 2's initialized memory"),
+    ('',  'snapshot-eos',   snapshotClangEos,   'store_true',   False,          True,           "Snapshot app 4's initialized memory"),
+    ('',  'memory-stress',  memoryStress,       'store_true',   False,          False,          "Check app 2's heap stays flat over 500 compiles"),
+    ('',  'template-stats', templateStatsClang, 'store',        False,          False,          "Tally the templates app 2 instantiates compiling each .cpp in a directory"),
+    ('',  'template-stats-eos', templateStatsClangEos, 'store',   False,          False,          "Tally the templates app 4 instantiates compiling each .cpp in a directory"),
+    ('',  'test',           test,               'store_true',   False,          False,          "Run the native checks of the linker"),
+    ('',  'test-extern-templates', testExternTemplates, 'store_true', False, False,    "Check where app 2 enters extern-templates.h"),
     ('H', 'http',           http,               'store_true',   False,          False,          "http-server"),
 ]
 
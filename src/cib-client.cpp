@@ -0,0 +1,123 @@
+// Copyright 2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Runs a command line on a clang or clang-eos started with --server socket
+// and exits with its status, e.g.
+//      clang-eos --server /tmp/clang-eos.sock &
+//      cib-client /tmp/clang-eos.sock -Os contract.cpp prelinked.wasm linked.wasm
+// See serve() in clang-server.cpp for the protocol.
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static bool read_all(int fd, void* data, size_t size) {
+    auto p = reinterpret_cast<char*>(data);
+    while (size) {
+        auto n = read(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool read_u32(int fd, uint32_t& value) {
+    uint8_t bytes[4];
+    if (!read_all(fd, bytes, 4))
+        return false;
+    value = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | uint32_t(bytes[3]) << 24;
+    return true;
+}
+
+static void push_u32(vector<uint8_t>& v, uint32_t value) {
+    for (int i = 0; i < 4; ++i)
+        v.push_back(value >> (8 * i));
+}
+
+static void push_str(vector<uint8_t>& v, const string& s) {
+    push_u32(v, s.size());
+    v.insert(v.end(), s.begin(), s.end());
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: socket args...\n");
+        return 1;
+    }
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("getcwd");
+        return 1;
+    }
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", argv[1]);
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 ||
+        connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) {
+        fprintf(stderr, "Unable to connect to %s: %s\n", argv[1],
+                strerror(errno));
+        return 1;
+    }
+
+    vector<uint8_t> request;
+    push_u32(request, argc - 1);
+    push_str(request, cwd);
+    for (int i = 2; i < argc; ++i)
+        push_str(request, argv[i]);
+    for (size_t pos = 0; pos < request.size();) {
+        auto n = write(fd, request.data() + pos, request.size() - pos);
+        if (n <= 0) {
+            perror("write");
+            return 1;
+        }
+        pos += n;
+    }
+
+    uint32_t status, size;
+    if (!read_u32(fd, status) || !read_u32(fd, size)) {
+        fprintf(stderr, "Server closed the connection\n");
+        return 1;
+    }
+    string output(size, 0);
+    if (!read_all(fd, &output[0], size)) {
+        fprintf(stderr, "Server closed the connection\n");
+        return 1;
+    }
+    fwrite(output.data(), 1, output.size(), stderr);
+    close(fd);
+    return status;
+}
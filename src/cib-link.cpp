@@ -26,7 +26,22 @@ using namespace WasmTools;
 int main(int argc, const char* argv[]) {
     try {
         Linked linked;
-        for (int i = 2; i < argc; ++i) {
+        int first = 1;
+        for (; first < argc && argv[first][0] == '-'; ++first) {
+            if (argv[first] == "--instrument"s) {
+                linked.instrument = true;
+            } else if (argv[first] == "--instrument-time"s) {
+                linked.instrument = true;
+                linked.instrument_time = true;
+            } else {
+                throw std::runtime_error("unknown option "s + argv[first]);
+            }
+        }
+        if (argc - first < 1)
+            throw std::runtime_error(
+                "usage: cib-link [--instrument | --instrument-time] "
+                "output inputs...");
+        for (int i = first + 1; i < argc; ++i) {
             if (debug_read)
                 printf("%d/%d\n", i, argc - 1);
             auto module = make_unique<Module>();
@@ -40,7 +55,7 @@ int main(int argc, const char* argv[]) {
             linked.modules.push_back(move(module));
         }
         link(linked);
-        File{argv[1], "wb"}.write(linked.binary);
+        File{argv[first], "wb"}.write(linked.binary);
     } catch (exception& e) {
         printf("error: %s\n", e.what());
         return 1;
@@ -0,0 +1,161 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <tuple>
+
+#include "clang/Basic/Version.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/PreprocessorOutputOptions.h"
+#include "clang/Frontend/Utils.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+
+#include "clang.h"
+
+// Compile cache entries from a different build of this compiler are ignored
+#ifndef CIB_BUILD_ID
+#define CIB_BUILD_ID __DATE__ " " __TIME__
+#endif
+
+#ifndef FAKE_COMPILE
+// Empty disables the compile cache
+std::string compileCacheDir;
+
+// Once the compile cache passes this size, its oldest entries are removed
+// until it's back under three quarters of it. In the browser the cache lives
+// in MEMFS, so it counts against the tab's memory.
+static const uint64_t compileCacheLimit = 64 * 1024 * 1024;
+
+extern "C" void set_compile_cache(const char* dir) {
+    compileCacheDir = dir;
+    if (!compileCacheDir.empty())
+        sys::fs::create_directories(compileCacheDir);
+}
+
+// Captures the preprocessed translation unit for the cache key
+struct PreprocessToStringAction : PreprocessorFrontendAction {
+    std::string& result;
+
+    PreprocessToStringAction(std::string& result) : result{result} {}
+
+    void ExecuteAction() override {
+        auto& compiler = getCompilerInstance();
+        raw_string_ostream os{result};
+        DoPrintPreprocessedInput(compiler.getPreprocessor(), &os,
+                                 compiler.getPreprocessorOutputOpts());
+    }
+};
+
+// Hashes everything which can change the object: the compiler build, the
+// options, and the preprocessed source. Line markers are left out so edits
+// which only move code around still hit.
+bool get_cache_key(std::string& key, const char* inputFilename,
+                   const char* sysDirs, IntrusiveRefCntPtr<vfs::FileSystem> fs,
+                   raw_ostream* diagnostics, bool optimize) {
+    auto compiler = create_compiler(inputFilename, "", sysDirs, fs,
+                                    diagnostics, optimize);
+    compiler->getPreprocessorOutputOpts().ShowCPP = 1;
+    compiler->getPreprocessorOutputOpts().ShowLineMarkers = 0;
+    std::string preprocessed;
+    PreprocessToStringAction act{preprocessed};
+    if (!compiler->ExecuteAction(act))
+        return false;
+
+    std::string options;
+    raw_string_ostream os{options};
+    os << CIB_BUILD_ID << '\n' << CLANG_VERSION_STRING << '\n';
+
+    auto& lOpts = compiler->getLangOpts();
+#define LANGOPT(Name, Bits, Default, Description) os << lOpts.Name << ' ';
+#define ENUM_LANGOPT(Name, Type, Bits, Default, Description)                    \
+    os << static_cast<unsigned>(lOpts.get##Name()) << ' ';
+#include "clang/Basic/LangOptions.def"
+    os << '\n';
+
+    auto& cgOpts = compiler->getCodeGenOpts();
+#define CODEGENOPT(Name, Bits, Default) os << cgOpts.Name << ' ';
+#define ENUM_CODEGENOPT(Name, Type, Bits, Default)                              \
+    os << static_cast<unsigned>(cgOpts.get##Name()) << ' ';
+#include "clang/Frontend/CodeGenOptions.def"
+    os << '\n'
+       << cgOpts.CodeModel << '\n'
+       << cgOpts.RelocationModel << '\n'
+       << cgOpts.ThreadModel << '\n';
+
+    auto& tOpts = compiler->getTargetOpts();
+    os << tOpts.Triple << '\n' << tOpts.CPU << '\n';
+    for (auto& feature : tOpts.FeaturesAsWritten)
+        os << feature << ' ';
+    os << '\n';
+    os.flush();
+
+    SHA1 sha;
+    sha.update(options);
+    sha.update(preprocessed);
+    key = toHex(sha.final());
+    return true;
+}
+
+// See compileCacheLimit
+static void prune_compile_cache() {
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock{mutex};
+    std::vector<std::tuple<sys::TimePoint<>, uint64_t, std::string>> entries;
+    uint64_t total = 0;
+    std::error_code ec;
+    for (sys::fs::directory_iterator it{compileCacheDir, ec}, end;
+         !ec && it != end; it.increment(ec)) {
+        sys::fs::file_status status;
+        if (sys::fs::status(it->path(), status) ||
+            status.type() != sys::fs::file_type::regular_file)
+            continue;
+        entries.emplace_back(status.getLastModificationTime(),
+                             status.getSize(), it->path());
+        total += status.getSize();
+    }
+    if (total <= compileCacheLimit)
+        return;
+    std::sort(entries.begin(), entries.end());
+    for (auto& [time, size, path] : entries) {
+        if (total <= compileCacheLimit / 4 * 3)
+            break;
+        if (!sys::fs::remove(path))
+            total -= size;
+    }
+}
+
+// Writes under a temporary name so a reader never sees a partial object.
+// Other threads and processes may be writing the same entry.
+void add_to_compile_cache(const std::string& cacheFile,
+                          const std::vector<uint8_t>& object) {
+    static std::atomic<unsigned> tmpCount{0};
+    auto tmp = cacheFile + "." + std::to_string(sys::Process::getProcessId()) +
+               "." + std::to_string(tmpCount++) + ".tmp";
+    if (!write_file(tmp, object) || rename(tmp.c_str(), cacheFile.c_str()))
+        remove(tmp.c_str());
+    prune_compile_cache();
+}
+#endif // FAKE_COMPILE
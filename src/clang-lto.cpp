@@ -0,0 +1,202 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include <map>
+#include <set>
+#include <shared_mutex>
+
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/CodeGen/TargetLowering.h"
+#include "llvm/CodeGen/TargetSubtargetInfo.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/DiagnosticPrinter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/LTO/LTO.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+
+#include "clang.h"
+
+#ifndef FAKE_COMPILE
+// rtl-eos compiled to bitcode (build.py --rtl-eos-bc), in the same cib-ar
+// format. definitions maps each symbol to the first member defining it.
+struct BitcodeArchive {
+    struct Member {
+        std::string name;
+        StringRef bitcode;
+    };
+
+    std::vector<uint8_t> content;
+    std::vector<Member> members;
+    std::map<std::string, size_t> definitions;
+};
+
+static const BitcodeArchive& get_rtl_eos_bitcode() {
+    static const auto archive = [] {
+        auto result = std::make_unique<BitcodeArchive>();
+        result->content =
+            read_sysroot_file(STRX(LIB_PREFIX) "build/rtl-eos-bc/rtl-eos");
+        auto& content = result->content;
+        size_t pos = 0;
+        while (pos < content.size()) {
+            auto sv = WasmTools::read_str(content, pos);
+            std::string name{begin(sv), end(sv)};
+            auto size = WasmTools::read_leb(content, pos);
+            if (pos + size > content.size())
+                throw std::runtime_error("rtl-eos bitcode archive truncated");
+            StringRef bitcode{
+                reinterpret_cast<const char*>(content.data() + pos), size};
+            pos += size;
+
+            // The bitcode's symbol table; cheaper than loading the module
+            auto input = lto::InputFile::create({bitcode, name});
+            if (!input)
+                throw std::runtime_error(name + ": " +
+                                         toString(input.takeError()));
+            for (auto& symbol : (*input)->symbols())
+                if (!symbol.isUndefined())
+                    result->definitions.emplace(symbol.getName(),
+                                                result->members.size());
+            result->members.push_back({name, bitcode});
+        }
+        return result;
+    }();
+    return *archive;
+}
+
+static std::unique_ptr<llvm::Module>
+parse_bitcode(StringRef bitcode, StringRef name, LLVMContext& context) {
+    auto module = parseBitcodeFile({bitcode, name}, context);
+    if (!module)
+        throw std::runtime_error(name.str() + ": " +
+                                 toString(module.takeError()));
+    return std::move(*module);
+}
+
+// Link-time optimization: merges the contract's bitcode with the rtl-eos
+// bitcode it reaches, searched like an archive, internalizes everything but
+// the entry points, optimizes the whole program, and emits one object. The
+// regular rtl-eos still goes into the final link for anything the backend
+// calls on its own (memcpy, compiler-rt).
+std::unique_ptr<WasmTools::Module>
+lto_object(std::vector<std::pair<std::string, std::vector<uint8_t>>> inputs,
+           bool optimize, uint32_t shrinkLevel) {
+    initialize_targets();
+    auto& archive = get_rtl_eos_bitcode();
+
+    LLVMContext context;
+    std::string errors;
+    raw_string_ostream errorStream{errors};
+    context.setDiagnosticHandlerCallBack(
+        [](const DiagnosticInfo& info, void* os) {
+            if (info.getSeverity() != DS_Error)
+                return;
+            DiagnosticPrinterRawOStream printer{*static_cast<raw_ostream*>(os)};
+            info.print(printer);
+            *static_cast<raw_ostream*>(os) << "\n";
+        },
+        &errorStream);
+    auto check_link = [&](bool failed) {
+        if (failed)
+            throw std::runtime_error("lto: " + errorStream.str());
+    };
+
+    auto merged = std::make_unique<llvm::Module>("lto", context);
+    for (auto& [name, bitcode] : inputs)
+        check_link(Linker::linkModules(
+            *merged,
+            parse_bitcode({reinterpret_cast<const char*>(bitcode.data()),
+                           bitcode.size()},
+                          name, context)));
+
+    // Pull in members until nothing new is undefined
+    std::vector<bool> used(archive.members.size());
+    for (bool changed = true; changed;) {
+        changed = false;
+        std::vector<size_t> needed;
+        for (auto& value : merged->global_values()) {
+            if (!value.isDeclaration() || value.getName().startswith("llvm."))
+                continue;
+            auto it = archive.definitions.find(value.getName());
+            if (it != archive.definitions.end() && !used[it->second]) {
+                used[it->second] = true;
+                needed.push_back(it->second);
+            }
+        }
+        for (auto i : needed) {
+            auto& member = archive.members[i];
+            check_link(Linker::linkModules(
+                *merged, parse_bitcode(member.bitcode, member.name, context)));
+            changed = true;
+        }
+    }
+
+    auto targetMachine = create_target_machine(optimize);
+    merged->setTargetTriple(triple);
+    merged->setDataLayout(targetMachine->createDataLayout());
+
+    // The backend may introduce calls to libcalls after they would have
+    // been internalized
+    std::set<std::string> preserve{"apply", "init"};
+    for (auto& function : *merged) {
+        if (function.isDeclaration())
+            continue;
+        auto* lowering =
+            targetMachine->getSubtargetImpl(function)->getTargetLowering();
+        for (int i = 0; i < RTLIB::UNKNOWN_LIBCALL; ++i)
+            if (auto name = lowering->getLibcallName(RTLIB::Libcall(i)))
+                preserve.insert(name);
+        break;
+    }
+    internalizeModule(*merged, [&](const GlobalValue& value) {
+        return preserve.count(value.getName());
+    });
+
+    legacy::PassManager passes;
+    passes.add(
+        createTargetTransformInfoWrapperPass(targetMachine->getTargetIRAnalysis()));
+    if (optimize) {
+        PassManagerBuilder builder;
+        builder.OptLevel = 2;
+        builder.SizeLevel = shrinkLevel;
+        builder.LibraryInfo = new TargetLibraryInfoImpl(Triple{triple});
+        builder.Inliner = createFunctionInliningPass(2, shrinkLevel, false);
+        builder.populateLTOPassManager(passes);
+    }
+    std::vector<uint8_t> object;
+    raw_vector_ostream os{object};
+    if (targetMachine->addPassesToEmitFile(passes, os,
+                                           TargetMachine::CGFT_ObjectFile))
+        throw std::runtime_error("lto: target can't emit an object");
+    check_cancelled();
+    std::shared_lock<std::shared_mutex> timersLock{passTimersMutex};
+    passes.run(*merged);
+    os.flush();
+    check_link(!errorStream.str().empty());
+    return read_object("lto.o", std::move(object));
+}
+#endif // FAKE_COMPILE
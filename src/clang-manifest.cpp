@@ -0,0 +1,168 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include <stdio.h>
+#include <chrono>
+#include <tuple>
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/LineIterator.h"
+
+#include "clang.h"
+
+#ifndef FAKE_COMPILE
+// A contract in a --manifest build
+struct ManifestEntry {
+    std::string linkedFile;
+    std::vector<std::string> inputs;
+    uint32_t stackSize = 16 * 1024;
+    uint32_t optimizeLevel = 0;
+    uint32_t shrinkLevel = 0;
+    bool lto = false;
+    unsigned partitions = 1;
+    uint32_t instrument = 0;
+
+    bool ok = false;
+    std::string log;
+    double compileSeconds = 0;
+    double linkSeconds = 0;
+};
+
+// Each line is [options] linked.wasm input.cpp..., where options are
+// -O0..-O4, -Os, -Oz, --lto, --stack=bytes, --partitions=n (see
+// compile_object()), and --instrument or --instrument-time (see
+// link_contract()). Blank lines and lines starting with # are skipped.
+static bool read_manifest(const char* filename,
+                          std::vector<ManifestEntry>& entries) {
+    auto buffer = MemoryBuffer::getFile(filename);
+    if (!buffer) {
+        fprintf(stderr, "%s: %s\n", filename,
+                buffer.getError().message().c_str());
+        return false;
+    }
+    for (line_iterator it{**buffer, true, '#'}; !it.is_at_end(); ++it) {
+        ManifestEntry entry;
+        for (auto rest = *it; !rest.trim().empty();) {
+            StringRef token;
+            std::tie(token, rest) = getToken(rest);
+            bool ok = true;
+            if (token.startswith("-O"))
+                ok = parse_optimize_level(token, entry.optimizeLevel,
+                                          entry.shrinkLevel);
+            else if (token == "--lto")
+                entry.lto = true;
+            else if (token.startswith("--stack="))
+                ok = !token.drop_front(8).getAsInteger(0, entry.stackSize);
+            else if (token.startswith("--partitions="))
+                ok = !token.drop_front(13).getAsInteger(0, entry.partitions) &&
+                     entry.partitions;
+            else if (token == "--instrument")
+                entry.instrument = 1;
+            else if (token == "--instrument-time")
+                entry.instrument = 2;
+            else if (token.startswith("-"))
+                ok = false;
+            else if (entry.linkedFile.empty())
+                entry.linkedFile = token.str();
+            else
+                entry.inputs.push_back(token.str());
+            if (!ok) {
+                fprintf(stderr, "%s:%d: unknown option %s\n", filename,
+                        int(it.line_number()), token.str().c_str());
+                return false;
+            }
+        }
+        if (entry.inputs.empty()) {
+            fprintf(stderr, "%s:%d: expected linked.wasm input.cpp...\n",
+                    filename, int(it.line_number()));
+            return false;
+        }
+        entries.push_back(std::move(entry));
+    }
+    return true;
+}
+
+// Compiles and links one manifest entry. Everything it would print goes to
+// entry.log.
+static void build_contract(ManifestEntry& entry) {
+    using clock = std::chrono::steady_clock;
+    auto seconds = [](clock::duration d) {
+        return std::chrono::duration<double>(d).count();
+    };
+    raw_string_ostream log{entry.log};
+    auto begin = clock::now();
+    std::vector<std::pair<std::string, std::vector<uint8_t>>> objects;
+    for (auto& input : entry.inputs) {
+        std::vector<uint8_t> object;
+        if (!compile_object(input.c_str(), "", get_sysroot_file_system(),
+                            &log, object, true, nullptr, entry.lto,
+                            entry.partitions)) {
+            entry.compileSeconds = seconds(clock::now() - begin);
+            return;
+        }
+        objects.emplace_back(input, std::move(object));
+    }
+    auto linkBegin = clock::now();
+    entry.compileSeconds = seconds(linkBegin - begin);
+    try {
+        WasmTools::Linked linked;
+        add_rtl_eos(linked);
+        auto contract = add_contract(linked, std::move(objects), entry.lto,
+                                     true, entry.shrinkLevel);
+        log.flush();
+        link_contract(linked, contract, entry.stackSize, entry.optimizeLevel,
+                      entry.shrinkLevel, entry.log, entry.instrument);
+        WasmTools::File{entry.linkedFile, "wb"}.write(linked.binary);
+        entry.ok = true;
+    } catch (std::exception& e) {
+        log << "error: " << e.what() << "\n";
+    }
+    entry.linkSeconds = seconds(clock::now() - linkBegin);
+}
+
+// Builds every contract in the manifest over parallel_for(). Each contract
+// compiles its files in order, so a large manifest keeps every thread busy
+// without oversubscribing. They all share the sysroot file cache, PCHs, the
+// compile cache and the rtl-eos archives. Logs and timings are printed in
+// manifest order once everything finishes.
+bool build_manifest(const char* filename) {
+    begin_cancellable();
+    std::vector<ManifestEntry> entries;
+    if (!read_manifest(filename, entries))
+        return false;
+    initialize_targets();
+    auto begin = std::chrono::steady_clock::now();
+    parallel_for(entries.size(), [&](size_t i) { build_contract(entries[i]); });
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - begin;
+
+    size_t built = 0;
+    for (auto& entry : entries) {
+        fputs(entry.log.c_str(), stdout);
+        printf("%s: %s, compile %.3fs, link %.3fs\n", entry.linkedFile.c_str(),
+               entry.ok ? "ok" : "failed", entry.compileSeconds,
+               entry.linkSeconds);
+        built += entry.ok;
+    }
+    printf("%zu of %zu contracts built in %.3fs\n", built, entries.size(),
+           elapsed.count());
+    return built == entries.size();
+}
+#endif // FAKE_COMPILE
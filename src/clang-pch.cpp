@@ -0,0 +1,147 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include <algorithm>
+#include <tuple>
+
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Lex/PreprocessorOptions.h"
+#include "clang/Serialization/ASTReader.h"
+#include "llvm/Support/Path.h"
+
+#include "clang.h"
+
+#ifndef FAKE_COMPILE
+// Returns the <...> includes at the top of a file, stopping at the first line
+// which isn't one of those, a comment, or blank
+static std::vector<std::string> get_leading_includes(StringRef source) {
+    std::vector<std::string> result;
+    bool inComment = false;
+    while (!source.empty()) {
+        StringRef line;
+        std::tie(line, source) = source.split('\n');
+        line = line.trim();
+        if (inComment) {
+            auto end = line.find("*/");
+            if (end == StringRef::npos)
+                continue;
+            line = line.substr(end + 2).ltrim();
+            inComment = false;
+        }
+        if (line.startswith("/*")) {
+            auto end = line.find("*/", 2);
+            if (end == StringRef::npos) {
+                inComment = true;
+                continue;
+            }
+            line = line.substr(end + 2).ltrim();
+        }
+        if (line.empty() || line.startswith("//"))
+            continue;
+        if (!line.consume_front("#"))
+            break;
+        line = line.ltrim();
+        if (!line.consume_front("include"))
+            break;
+        line = line.ltrim();
+        if (!line.consume_front("<"))
+            break;
+        auto end = line.find('>');
+        if (end == StringRef::npos)
+            break;
+        result.push_back(line.substr(0, end));
+    }
+    return result;
+}
+
+// Picks the largest header set which the source includes in full before
+// anything else. The standard library headers may be included in any order,
+// so the set's order doesn't need to match.
+static std::string find_pch(StringRef source) {
+    struct HeaderSet {
+        std::string pch;
+        std::vector<std::string> includes;
+    };
+    // Through the sysroot file system, since pchDir may be in an archive
+    static auto headerSets = [] {
+        std::vector<HeaderSet> result;
+        auto fs = get_sysroot_file_system();
+        std::error_code ec;
+        for (auto it = fs->dir_begin(pchDir, ec), end = vfs::directory_iterator{};
+             it != end && !ec; it.increment(ec)) {
+            auto path = it->getName().str();
+            if (sys::path::extension(path) != ".h")
+                continue;
+            auto pch = path.substr(0, path.size() - 2) + ".pch";
+            auto header = fs->getBufferForFile(path);
+            if (header && fs->exists(pch))
+                result.push_back(
+                    {pch, get_leading_includes((*header)->getBuffer())});
+        }
+        return result;
+    }();
+
+    auto includes = get_leading_includes(source);
+    std::string best;
+    size_t bestSize = 0;
+    for (auto& set : headerSets) {
+        if (set.includes.size() <= bestSize)
+            continue;
+        if (std::all_of(set.includes.begin(), set.includes.end(),
+                        [&](auto& name) {
+                            return std::find(includes.begin(), includes.end(),
+                                             name) != includes.end();
+                        })) {
+            best = set.pch;
+            bestSize = set.includes.size();
+        }
+    }
+    return best;
+}
+
+void use_pch(CompilerInstance& compiler, const char* inputFilename) {
+    auto source =
+        compiler.getVirtualFileSystem().getBufferForFile(inputFilename);
+    if (!source)
+        return;
+    auto pch = find_pch((*source)->getBuffer());
+    if (pch.empty())
+        return;
+    compiler.createFileManager();
+    if (!ASTReader::isAcceptableASTFile(
+            pch, compiler.getFileManager(), compiler.getPCHContainerReader(),
+            compiler.getLangOpts(), compiler.getTargetOpts(),
+            compiler.getPreprocessorOpts(), ""))
+        return;
+    compiler.getPreprocessorOpts().ImplicitPCHInclude = pch;
+    // isAcceptableASTFile() checked the options. Skip the input file checks;
+    // the header set was compiled at a different path.
+    compiler.getPreprocessorOpts().DisablePCHValidation = true;
+}
+
+bool generate_pch(const char* headerFilename, const char* pchFilename) {
+    initialize_targets();
+    auto compiler = create_compiler(headerFilename, pchFilename, "");
+    compiler->getFrontendOpts().RelocatablePCH = true;
+    compiler->getFrontendOpts().IncludeTimestamps = false;
+    GeneratePCHAction act;
+    return compiler->ExecuteAction(act);
+}
+#endif // FAKE_COMPILE
@@ -0,0 +1,193 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "clang.h"
+
+#if !defined(FAKE_COMPILE) && !defined(__EMSCRIPTEN__)
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// --server keeps one process alive across jobs so targets, the sysroot file
+// cache, PCHs and (clang-eos) rtl-eos are loaded once instead of per file.
+// Each job is a command line, taken the same way as main()'s, and jobs run one
+// at a time. The protocol is used over stdin/stdout, or per connection on a
+// unix socket (see cib-client.cpp):
+//      request:    u32 count, then count strings: the client's cwd, then args
+//      response:   u32 exit status, then a string holding the job's output
+// A string is its u32 size followed by its bytes. u32s are little-endian.
+
+static bool read_all(int fd, void* data, size_t size) {
+    auto p = reinterpret_cast<char*>(data);
+    while (size) {
+        auto n = read(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void* data, size_t size) {
+    auto p = reinterpret_cast<const char*>(data);
+    while (size) {
+        auto n = write(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool read_u32(int fd, uint32_t& value) {
+    uint8_t bytes[4];
+    if (!read_all(fd, bytes, 4))
+        return false;
+    value = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | uint32_t(bytes[3]) << 24;
+    return true;
+}
+
+static bool write_u32(int fd, uint32_t value) {
+    uint8_t bytes[4] = {uint8_t(value), uint8_t(value >> 8),
+                        uint8_t(value >> 16), uint8_t(value >> 24)};
+    return write_all(fd, bytes, 4);
+}
+
+// Runs a job with stdout and stderr going to a temporary file, then returns
+// what it printed
+static int run_captured(const std::vector<std::string>& args,
+                        std::string& output) {
+    std::vector<const char*> argv{"server"};
+    for (auto& arg : args)
+        argv.push_back(arg.c_str());
+    argv.push_back(nullptr);
+
+    auto file = tmpfile();
+    if (!file) {
+        output = "error: unable to create job output file\n";
+        return 1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    int savedOut = dup(1), savedErr = dup(2);
+    dup2(fileno(file), 1);
+    dup2(fileno(file), 2);
+    int status;
+    try {
+        status = run(argv.size() - 1, argv.data());
+    } catch (std::exception& e) {
+        printf("error: %s\n", e.what());
+        status = 1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    errs().flush();
+    dup2(savedOut, 1);
+    dup2(savedErr, 2);
+    close(savedOut);
+    close(savedErr);
+
+    auto size = lseek(fileno(file), 0, SEEK_END);
+    output.resize(size > 0 ? size : 0);
+    lseek(fileno(file), 0, SEEK_SET);
+    if (!read_all(fileno(file), &output[0], output.size()))
+        output.clear();
+    fclose(file);
+    return status;
+}
+
+// Serves jobs until the client closes its end
+static void serve_connection(int in, int out) {
+    while (true) {
+        uint32_t count;
+        if (!read_u32(in, count) || !count)
+            return;
+        std::vector<std::string> strings(count);
+        for (auto& s : strings) {
+            uint32_t size;
+            if (!read_u32(in, size))
+                return;
+            s.resize(size);
+            if (!read_all(in, &s[0], size))
+                return;
+        }
+        int status;
+        std::string output;
+        if (chdir(strings[0].c_str())) {
+            output = "error: unable to change to directory '" + strings[0] +
+                     "'\n";
+            status = 1;
+        } else {
+            status = run_captured({strings.begin() + 1, strings.end()},
+                                  output);
+        }
+        if (!write_u32(out, status) || !write_u32(out, output.size()) ||
+            !write_all(out, output.data(), output.size()))
+            return;
+    }
+}
+
+int serve(const char* socketPath) {
+    signal(SIGPIPE, SIG_IGN);
+    // Keeps printf and errs() output in order, as on a terminal
+    setvbuf(stdout, nullptr, _IOLBF, BUFSIZ);
+    if (!socketPath) {
+        // Anything stray on stdout would corrupt the responses
+        int out = dup(1);
+        dup2(2, 1);
+        serve_connection(0, out);
+        return 0;
+    }
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socketPath);
+        return 1;
+    }
+    strcpy(addr.sun_path, socketPath);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath);
+    if (listener < 0 ||
+        bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ||
+        listen(listener, 16)) {
+        fprintf(stderr, "Unable to listen on %s: %s\n", socketPath,
+                strerror(errno));
+        return 1;
+    }
+    while (true) {
+        int connection = accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+            return 1;
+        }
+        serve_connection(connection, connection);
+        close(connection);
+    }
+}
+#endif // !FAKE_COMPILE && !__EMSCRIPTEN__
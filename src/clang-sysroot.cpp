@@ -0,0 +1,181 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include "clang.h"
+
+#ifndef FAKE_COMPILE
+// The sysroot (LIB_PREFIX, pchDir and mounted archives) doesn't change while
+// we're running, so its stats, including misses from header search, and its
+// contents are kept across compiles. Everything else, including the user's
+// source and any sysDirs, goes to the real file system every time. This sits
+// below FileManager, which caches sizes and would hand back stale user files
+// if it were shared. Archives mounted with mount() sit over the real file
+// system.
+//
+// Both caches are capped, since the browser's heap never shrinks. Once the
+// contents pass their limit, the least recently opened files are dropped
+// until they're back under three quarters of it; a compile that still has one
+// open keeps it alive until it's done. Stats are small, so they're just
+// cleared when there are too many.
+class SysrootFileSystem : public vfs::FileSystem {
+    struct Content {
+        std::shared_ptr<const MemoryBuffer> buffer;
+        uint64_t lastUse;
+    };
+
+    static const size_t contentLimit = 32 * 1024 * 1024;
+    static const size_t statusLimit = 100000;
+
+    IntrusiveRefCntPtr<vfs::OverlayFileSystem> real =
+        make_intr<vfs::OverlayFileSystem>(vfs::getRealFileSystem());
+    std::vector<std::string> mountPoints;
+    std::mutex mutex;
+    std::map<std::string, ErrorOr<vfs::Status>> statuses;
+    std::map<std::string, Content> contents;
+    size_t contentBytes = 0;
+    uint64_t uses = 0;
+
+    bool is_sysroot(StringRef path) const {
+        if (path.startswith(STRX(LIB_PREFIX)) || path.startswith(pchDir))
+            return true;
+        for (auto& mountPoint : mountPoints)
+            if (path.startswith(mountPoint))
+                return true;
+        return false;
+    }
+
+    void prune_contents() {
+        std::vector<std::pair<uint64_t, std::string>> entries;
+        for (auto& [name, content] : contents)
+            entries.emplace_back(content.lastUse, name);
+        std::sort(entries.begin(), entries.end());
+        for (auto& [lastUse, name] : entries) {
+            if (contentBytes <= contentLimit / 4 * 3)
+                break;
+            auto it = contents.find(name);
+            contentBytes -= it->second.buffer->getBufferSize();
+            contents.erase(it);
+        }
+    }
+
+  public:
+    // Entries, including misses, and the bytes of file content cached
+    std::pair<size_t, size_t> cache_size() {
+        std::lock_guard<std::mutex> lock{mutex};
+        return {statuses.size(), contentBytes};
+    }
+
+    // Not while compiling
+    void mount(IntrusiveRefCntPtr<vfs::FileSystem> fs, StringRef mountPoint) {
+        std::lock_guard<std::mutex> lock{mutex};
+        real->pushOverlay(fs);
+        mountPoints.push_back((mountPoint.rtrim('/') + "/").str());
+        statuses.clear();
+        contents.clear();
+        contentBytes = 0;
+    }
+
+    ErrorOr<vfs::Status> status(const Twine& path) override {
+        auto name = path.str();
+        if (!is_sysroot(name))
+            return real->status(name);
+        std::lock_guard<std::mutex> lock{mutex};
+        auto it = statuses.find(name);
+        if (it == statuses.end()) {
+            if (statuses.size() >= statusLimit)
+                statuses.clear();
+            it = statuses.emplace(name, real->status(name)).first;
+        }
+        return it->second;
+    }
+
+    ErrorOr<std::unique_ptr<vfs::File>>
+    openFileForRead(const Twine& path) override {
+        auto name = path.str();
+        if (!is_sysroot(name))
+            return real->openFileForRead(name);
+        auto fileStatus = status(name);
+        if (!fileStatus)
+            return fileStatus.getError();
+        std::lock_guard<std::mutex> lock{mutex};
+        auto it = contents.find(name);
+        if (it == contents.end()) {
+            auto file = real->openFileForRead(name);
+            if (!file)
+                return file.getError();
+            auto buffer = (*file)->getBuffer(name, fileStatus->getSize());
+            if (!buffer)
+                return buffer.getError();
+            contentBytes += (*buffer)->getBufferSize();
+            it = contents.emplace(name, Content{std::move(*buffer), 0}).first;
+        }
+        it->second.lastUse = ++uses;
+        auto buffer = it->second.buffer;
+        if (contentBytes > contentLimit)
+            prune_contents();
+        return std::unique_ptr<vfs::File>{
+            std::make_unique<CachedFile>(*fileStatus, std::move(buffer))};
+    }
+
+    vfs::directory_iterator dir_begin(const Twine& dir,
+                                      std::error_code& ec) override {
+        return real->dir_begin(dir, ec);
+    }
+
+    std::error_code setCurrentWorkingDirectory(const Twine& path) override {
+        return real->setCurrentWorkingDirectory(path);
+    }
+
+    ErrorOr<std::string> getCurrentWorkingDirectory() const override {
+        return real->getCurrentWorkingDirectory();
+    }
+};
+
+static IntrusiveRefCntPtr<SysrootFileSystem> get_sysroot() {
+    static IntrusiveRefCntPtr<SysrootFileSystem> fs = new SysrootFileSystem;
+    return fs;
+}
+
+IntrusiveRefCntPtr<vfs::FileSystem> get_sysroot_file_system() {
+    return get_sysroot();
+}
+
+void mount_sysroot(IntrusiveRefCntPtr<vfs::FileSystem> fs,
+                   StringRef mountPoint) {
+    get_sysroot()->mount(std::move(fs), mountPoint);
+}
+
+std::pair<size_t, size_t> get_sysroot_cache_size() {
+    return get_sysroot()->cache_size();
+}
+
+std::vector<uint8_t> read_sysroot_file(const char* filename) {
+    auto buffer = get_sysroot()->getBufferForFile(filename);
+    if (!buffer)
+        throw std::runtime_error(filename + ": "s +
+                                 buffer.getError().message());
+    return {(*buffer)->getBufferStart(), (*buffer)->getBufferEnd()};
+}
+#endif // FAKE_COMPILE
@@ -0,0 +1,282 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <stdexcept>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "clang.h"
+#include <zlib.h>
+
+#ifndef FAKE_COMPILE
+// A zip archive mounted read-only at a directory. The central directory is
+// the index, so mounting only reads that; each member is inflated when it's
+// opened. Nothing inflated is kept here; SysrootFileSystem caches what's
+// opened through it, within its limit. Zip rather than a format of our own
+// so users' header zips mount as they are. No zip64; members must be stored or deflated.
+class ZipFileSystem : public vfs::FileSystem {
+    struct Member {
+        uint16_t method;
+        uint32_t compressedSize;
+        uint32_t size;
+        uint32_t localHeader;
+    };
+
+    std::shared_ptr<const void> owner;
+    StringRef archive;
+    std::string cwd = "/";
+    std::string mountPoint;
+    std::map<std::string, Member> members;
+    std::set<std::string> directories;
+
+    uint32_t read16(size_t pos) const {
+        if (pos + 2 > archive.size())
+            throw std::runtime_error("archive truncated");
+        auto p = reinterpret_cast<const uint8_t*>(archive.data()) + pos;
+        return p[0] | p[1] << 8;
+    }
+
+    uint32_t read32(size_t pos) const {
+        return read16(pos) | read16(pos + 2) << 16;
+    }
+
+    void add_directories(StringRef path) {
+        while (path.size() > mountPoint.size()) {
+            path = sys::path::parent_path(path);
+            if (!directories.insert(path.str()).second)
+                break;
+        }
+    }
+
+    std::string get_path(const Twine& path) const {
+        SmallString<256> result;
+        path.toVector(result);
+        if (!sys::path::is_absolute(result)) {
+            SmallString<256> relative = std::move(result);
+            result = cwd;
+            sys::path::append(result, relative);
+        }
+        sys::path::remove_dots(result, true);
+        return result.str();
+    }
+
+    vfs::Status get_status(const std::string& path, const Member* member) {
+        return {path,
+                sys::fs::UniqueID{reinterpret_cast<uintptr_t>(this),
+                                  std::hash<std::string>{}(path)},
+                sys::TimePoint<>{},
+                0,
+                0,
+                member ? member->size : 0,
+                member ? sys::fs::file_type::regular_file
+                       : sys::fs::file_type::directory_file,
+                sys::fs::perms::all_read};
+    }
+
+    std::unique_ptr<MemoryBuffer> extract(const Member& member,
+                                          const std::string& path) const {
+        if (read32(member.localHeader) != 0x04034b50)
+            throw std::runtime_error("bad local header");
+        auto begin = member.localHeader + 30 + read16(member.localHeader + 26) +
+                     read16(member.localHeader + 28);
+        if (begin + member.compressedSize > archive.size())
+            throw std::runtime_error("archive truncated");
+        auto content =
+            WritableMemoryBuffer::getNewUninitMemBuffer(member.size, path);
+        if (!content)
+            throw std::runtime_error("out of memory");
+        if (member.method == 0) {
+            memcpy(content->getBufferStart(), archive.data() + begin,
+                   member.size);
+        } else {
+            z_stream stream{};
+            stream.next_in = (Bytef*)(archive.data() + begin);
+            stream.avail_in = member.compressedSize;
+            stream.next_out = (Bytef*)content->getBufferStart();
+            stream.avail_out = member.size;
+            if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+                throw std::runtime_error("inflateInit2 failed");
+            auto result = inflate(&stream, Z_FINISH);
+            inflateEnd(&stream);
+            if (result != Z_STREAM_END || stream.total_out != member.size)
+                throw std::runtime_error("bad deflate data");
+        }
+        return std::move(content);
+    }
+
+    struct DirIter : vfs::detail::DirIterImpl {
+        std::vector<vfs::Status> entries;
+        size_t pos = 0;
+
+        DirIter(std::vector<vfs::Status> entries) : entries{std::move(entries)} {
+            increment();
+        }
+
+        std::error_code increment() override {
+            if (pos < entries.size())
+                CurrentEntry = entries[pos++];
+            else
+                CurrentEntry = {};
+            return {};
+        }
+    };
+
+  public:
+    // owner keeps archive alive. Throws if archive isn't a zip.
+    ZipFileSystem(std::shared_ptr<const void> owner, StringRef archive,
+                  StringRef mountPoint)
+        : owner{std::move(owner)}, archive{archive},
+          mountPoint{get_path(mountPoint)} {
+        directories.insert(this->mountPoint);
+        if (archive.size() < 22)
+            throw std::runtime_error("not a zip file");
+        // End of central directory, possibly followed by a comment
+        size_t end = archive.size() - 22;
+        while (read32(end) != 0x06054b50) {
+            if (!end || archive.size() - end > 22 + 0xffff)
+                throw std::runtime_error("not a zip file");
+            --end;
+        }
+        auto count = read16(end + 10);
+        size_t pos = read32(end + 16);
+        for (uint32_t i = 0; i < count; ++i) {
+            if (read32(pos) != 0x02014b50)
+                throw std::runtime_error("bad central directory");
+            Member member{};
+            member.method = read16(pos + 10);
+            member.compressedSize = read32(pos + 20);
+            member.size = read32(pos + 24);
+            member.localHeader = read32(pos + 42);
+            auto nameSize = read16(pos + 28);
+            if (pos + 46 + nameSize > archive.size())
+                throw std::runtime_error("archive truncated");
+            auto name = archive.substr(pos + 46, nameSize);
+            pos += 46 + nameSize + read16(pos + 30) + read16(pos + 32);
+            if (member.method != 0 && member.method != 8)
+                throw std::runtime_error(name.str() + ": unsupported method");
+            SmallString<256> path{this->mountPoint};
+            sys::path::append(path, name);
+            if (name.endswith("/")) {
+                directories.insert(get_path(path));
+                add_directories(get_path(path));
+            } else {
+                auto p = get_path(path);
+                add_directories(p);
+                members.emplace(p, std::move(member));
+            }
+        }
+    }
+
+    ErrorOr<vfs::Status> status(const Twine& path) override {
+        auto p = get_path(path);
+        auto it = members.find(p);
+        if (it != members.end())
+            return get_status(p, &it->second);
+        if (directories.count(p))
+            return get_status(p, nullptr);
+        return std::make_error_code(std::errc::no_such_file_or_directory);
+    }
+
+    ErrorOr<std::unique_ptr<vfs::File>>
+    openFileForRead(const Twine& path) override {
+        auto p = get_path(path);
+        auto it = members.find(p);
+        if (it == members.end())
+            return std::make_error_code(std::errc::no_such_file_or_directory);
+        try {
+            return std::unique_ptr<vfs::File>{std::make_unique<CachedFile>(
+                get_status(p, &it->second), extract(it->second, p))};
+        } catch (std::exception& e) {
+            errs() << "error: " << p << ": " << e.what() << "\n";
+            return std::make_error_code(std::errc::io_error);
+        }
+    }
+
+    vfs::directory_iterator dir_begin(const Twine& dir,
+                                      std::error_code& ec) override {
+        auto p = get_path(dir);
+        if (!directories.count(p)) {
+            ec = std::make_error_code(std::errc::no_such_file_or_directory);
+            return {};
+        }
+        std::vector<vfs::Status> entries;
+        for (auto it = directories.upper_bound(p);
+             it != directories.end() && StringRef{*it}.startswith(p); ++it)
+            if (sys::path::parent_path(*it) == p)
+                entries.push_back(get_status(*it, nullptr));
+        for (auto it = members.upper_bound(p);
+             it != members.end() && StringRef{it->first}.startswith(p); ++it)
+            if (sys::path::parent_path(it->first) == p)
+                entries.push_back(get_status(it->first, &it->second));
+        ec = {};
+        return vfs::directory_iterator{
+            std::make_shared<DirIter>(std::move(entries))};
+    }
+
+    std::error_code setCurrentWorkingDirectory(const Twine& path) override {
+        cwd = get_path(path);
+        return {};
+    }
+
+    ErrorOr<std::string> getCurrentWorkingDirectory() const override {
+        return cwd;
+    }
+};
+
+static bool mount_zip(std::shared_ptr<const void> owner, StringRef archive,
+                      const char* mountPoint) {
+    try {
+        mount_sysroot(
+            make_intr<ZipFileSystem>(std::move(owner), archive, mountPoint),
+            mountPoint);
+        return true;
+    } catch (std::exception& e) {
+        errs() << "error: " << mountPoint << ": " << e.what() << "\n";
+        return false;
+    }
+}
+
+// Mounts a zip (the sysroot, or a library's headers) at mountPoint. Takes
+// ownership of data, which must come from malloc(); the browser hands over
+// the download without a copy through MEMFS.
+extern "C" bool mount_archive(const char* mountPoint, uint8_t* data,
+                              uint32_t size) {
+    return mount_zip(std::shared_ptr<uint8_t>{data, free},
+                     {reinterpret_cast<const char*>(data), size}, mountPoint);
+}
+
+extern "C" bool mount_archive_file(const char* filename,
+                                   const char* mountPoint) {
+    auto buffer = MemoryBuffer::getFile(filename, -1, false);
+    if (!buffer) {
+        errs() << "error: " << filename << ": " << buffer.getError().message()
+               << "\n";
+        return false;
+    }
+    std::shared_ptr<MemoryBuffer> owner = std::move(*buffer);
+    return mount_zip(owner, owner->getBuffer(), mountPoint);
+}
+#endif // FAKE_COMPILE
@@ -18,40 +18,201 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 // DEALINGS IN THE SOFTWARE.
 
+#include <malloc.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <tuple>
 
+#include "clang/Basic/VirtualFileSystem.h"
 #include "clang/CodeGen/CodeGenAction.h"
 #include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/FrontendActions.h"
 #include "clang/Frontend/FrontendDiagnostic.h"
+#include "clang/Frontend/FrontendPluginRegistry.h"
+#include "clang/Frontend/MultiplexConsumer.h"
+#include "clang/Frontend/PrecompiledPreamble.h"
 #include "clang/Frontend/TextDiagnosticBuffer.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Lex/PPCallbacks.h"
+#include "clang/Lex/Preprocessor.h"
 #include "clang/Lex/PreprocessorOptions.h"
+#include "clang/Sema/Sema.h"
+#include "clang/Sema/TemplateInstCallback.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/CodeGen/ParallelCG.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Target/TargetMachine.h"
 
-#include "wasm-tools.h"
+#include "clang.h"
+#ifdef __EMSCRIPTEN__
+#include <emscripten.h>
+#endif
+#ifdef EOS_CLANG
+#include "wasm-optimize.h"
+#endif
 
-using namespace llvm;
-using namespace clang;
-using namespace std::literals;
+// extern template declarations for what rtl or rtl-eos instantiates; see
+// ExternTemplatesPlugin and src/rtl/extern-templates.h. CIB_EXTERN_TEMPLATES
+// overrides it (see src/test/extern-templates.cpp).
+#ifdef EXTERN_TEMPLATES
+static const char* externTemplates = STRX(EXTERN_TEMPLATES);
+#elif defined(EOS_CLANG)
+static const char* externTemplates =
+    STRX(LIB_PREFIX) "src/rtl-eos/extern-templates.h";
+#else
+static const char* externTemplates =
+    STRX(LIB_PREFIX) "src/rtl/extern-templates.h";
+#endif
 
-#define STRX(s) STR(s)
-#define STR(s) #s
+#ifndef FAKE_COMPILE
+// Layout shared with heapStats() in process-clang.js
+struct HeapStats {
+    // Bytes malloc has taken from the system. The wasm heap never shrinks,
+    // so in the browser this is also the high-water mark.
+    uint32_t heapSize;
+    // Bytes in allocated blocks
+    uint32_t inUse;
+    // The state kept between compiles: the sysroot cache's entries
+    // (including misses) and contents, and check_syntax()'s preamble
+    uint32_t sysrootEntries;
+    uint32_t sysrootBytes;
+    uint32_t preambleBytes;
+};
+
+// Size of the preamble check_syntax() is holding
+static std::atomic<size_t> syntaxPreambleBytes{0};
 
-template <typename T, typename... A> IntrusiveRefCntPtr<T> make_intr(A&&... a) {
-    return {new T{std::forward<A>(a)...}};
+extern "C" void get_heap_stats(HeapStats* stats) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    auto info = mallinfo2();
+#else
+    auto info = mallinfo();
+#endif
+    stats->heapSize = info.arena + info.hblkhd;
+    stats->inUse = info.uordblks + info.hblkhd;
+    auto [entries, bytes] = get_sysroot_cache_size();
+    stats->sysrootEntries = entries;
+    stats->sysrootBytes = bytes;
+    stats->preambleBytes = syntaxPreambleBytes;
 }
 
-static auto triple = "wasm32-unknown-unknown-wasm";
+// Splits a ':'-separated list, skipping empty entries
+static std::vector<std::string> split_list(const char* list) {
+    std::vector<std::string> result;
+    while (*list) {
+        auto end = list;
+        while (*end && *end != ':')
+            ++end;
+        if (list != end)
+            result.emplace_back(list, end);
+        if (*end == ':')
+            ++end;
+        list = end;
+    }
+    return result;
+}
 
-#ifndef FAKE_COMPILE
-extern "C" bool compile(const char* inputFilename, const char* outputFilename,
-                        const char* sysDirs) {
-    llvm::InitializeAllTargets();
-    llvm::InitializeAllTargetMCs();
-    llvm::InitializeAllAsmPrinters();
-    llvm::InitializeAllAsmParsers();
+// Enters externTemplates right after the file which defined one of the
+// libc++ include guards it tests, as if that file had included it at its
+// end. A forced include would come before the source's own includes, where
+// nothing it names is defined yet. So would entering it as soon as a guard
+// is defined: libc++ defines it before including anything, and the first
+// file to end after that is <__config>. Entered once per guard; the header
+// declares each of its sections at most once. A guard defined by a PCH or a
+// preamble was already handled when that was built.
+struct ExternTemplatesCallbacks : PPCallbacks {
+    static constexpr const char* guards[] = {"_LIBCPP_VECTOR",
+                                             "_LIBCPP_STRING"};
 
+    Preprocessor& preprocessor;
+    const FileEntry* header;
+    bool entered[std::size(guards)]{};
+
+    ExternTemplatesCallbacks(Preprocessor& preprocessor,
+                             const FileEntry* header)
+        : preprocessor{preprocessor}, header{header} {}
+
+    void FileChanged(SourceLocation loc, FileChangeReason reason,
+                     SrcMgr::CharacteristicKind fileType,
+                     FileID prevFID) override {
+        if (reason != ExitFile)
+            return;
+        auto& sourceManager = preprocessor.getSourceManager();
+        bool enter = false;
+        for (size_t i = 0; i < std::size(guards); ++i) {
+            if (entered[i])
+                continue;
+            auto macro = preprocessor.getMacroInfo(
+                preprocessor.getIdentifierInfo(guards[i]));
+            if (macro &&
+                sourceManager.getFileID(macro->getDefinitionLoc()) == prevFID)
+                entered[i] = enter = true;
+        }
+        if (enter)
+            preprocessor.EnterSourceFile(
+                sourceManager.createFileID(header, loc, SrcMgr::C_System),
+                nullptr, loc);
+    }
+};
+
+// Installs ExternTemplatesCallbacks in every compile which parses, including
+// PCHs and check_syntax()'s preamble. Applies only when create_compiler()
+// passes the header's path as the plugin's argument.
+struct ExternTemplatesPlugin : PluginASTAction {
+    std::string header;
+
+    ActionType getActionType() override { return AddBeforeMainAction; }
+
+    bool ParseArgs(const CompilerInstance& compiler,
+                   const std::vector<std::string>& args) override {
+        if (args.size() != 1)
+            return false;
+        header = args[0];
+        return true;
+    }
+
+    std::unique_ptr<ASTConsumer>
+    CreateASTConsumer(CompilerInstance& compiler, StringRef inFile) override {
+        if (auto file = compiler.getFileManager().getFile(header))
+            compiler.getPreprocessor().addPPCallbacks(
+                std::make_unique<ExternTemplatesCallbacks>(
+                    compiler.getPreprocessor(), file));
+        return std::make_unique<ASTConsumer>();
+    }
+};
+
+static FrontendPluginRegistry::Add<ExternTemplatesPlugin>
+    externTemplatesPlugin{"cib-extern-templates",
+                          "declare rtl's template instantiations extern"};
+
+std::unique_ptr<CompilerInstance>
+create_compiler(const char* inputFilename, const char* outputFilename,
+                const char* sysDirs, IntrusiveRefCntPtr<vfs::FileSystem> fs,
+                raw_ostream* diagnostics, bool optimize) {
     auto compiler = std::make_unique<CompilerInstance>();
-    compiler->createDiagnostics();
+    if (diagnostics)
+        compiler->createDiagnostics(
+            new TextDiagnosticPrinter{*diagnostics,
+                                      &compiler->getDiagnosticOpts()});
+    else
+        compiler->createDiagnostics();
+    compiler->setVirtualFileSystem(fs);
 
     CompilerInvocation::setLangDefaults(
         compiler->getLangOpts(), InputKind{InputKind::CXX, InputKind::Source},
@@ -63,21 +224,13 @@ extern "C" bool compile(const char* inputFilename, const char* outputFilename,
     compiler->getFrontendOpts().OutputFile = outputFilename;
 
     auto& sOpts = compiler->getHeaderSearchOpts();
+    sOpts.Sysroot = STRX(LIB_PREFIX); // PCHs store paths relative to this
     sOpts.UseBuiltinIncludes = false;
     sOpts.UseStandardSystemIncludes = false;
     sOpts.UseStandardCXXIncludes = false;
 
-    while (*sysDirs) {
-        auto end = sysDirs;
-        while (*end && *end != ':')
-            ++end;
-        if (sysDirs != end)
-            sOpts.AddPath(std::string{sysDirs, end}, frontend::System, false,
-                          true);
-        if (*end == ':')
-            ++end;
-        sysDirs = end;
-    }
+    for (auto& dir : split_list(sysDirs))
+        sOpts.AddPath(dir, frontend::System, false, true);
 
 #ifdef EOS_CLANG
     sOpts.AddPath(STRX(LIB_PREFIX) "repos/eos-libcxx/include", frontend::System,
@@ -130,11 +283,18 @@ extern "C" bool compile(const char* inputFilename, const char* outputFilename,
     compiler->getPreprocessorOpts().addMacroDef("__unix__");
 #endif
 
+    // A sysroot without it predates rtl's instantiations
+    if (fs->status(externTemplates))
+        compiler->getFrontendOpts().PluginArgs["cib-extern-templates"] = {
+            externTemplates};
+
     compiler->getCodeGenOpts().CodeModel = "default";
     compiler->getCodeGenOpts().RelocationModel = "static";
     compiler->getCodeGenOpts().ThreadModel = "single";
-    compiler->getCodeGenOpts().OptimizationLevel = 2; // -Os
-    compiler->getCodeGenOpts().OptimizeSize = 1;      // -Os
+    compiler->getCodeGenOpts().OptimizationLevel = optimize ? 2 : 0; // -Os
+    compiler->getCodeGenOpts().OptimizeSize = optimize;              // -Os
+    // Unoptimized builds keep these so they see the same macros as optimized
+    // ones and can share their PCHs
     compiler->getLangOpts().Optimize = 1;
     compiler->getLangOpts().OptimizeSize = 1;
 
@@ -162,14 +322,772 @@ extern "C" bool compile(const char* inputFilename, const char* outputFilename,
 
     compiler->getTargetOpts().Triple = triple;
     compiler->getTargetOpts().HostTriple = triple;
+    return compiler;
+}
+
+void initialize_targets() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        llvm::InitializeAllTargets();
+        llvm::InitializeAllTargetMCs();
+        llvm::InitializeAllAsmPrinters();
+        llvm::InitializeAllAsmParsers();
+    });
+}
+
+bool read_file(const std::string& filename, std::vector<uint8_t>& content) {
+    auto buffer = MemoryBuffer::getFile(filename, -1, false);
+    if (!buffer)
+        return false;
+    content.assign((*buffer)->getBufferStart(), (*buffer)->getBufferEnd());
+    return true;
+}
+
+bool write_file(const std::string& filename,
+                const std::vector<uint8_t>& content) {
+    std::error_code ec;
+    raw_fd_ostream os{filename, ec, sys::fs::F_None};
+    if (ec)
+        return false;
+    os.write(reinterpret_cast<const char*>(content.data()), content.size());
+    os.close();
+    auto ok = !os.has_error();
+    os.clear_error();
+    return ok;
+}
 
-    auto act = std::make_unique<EmitObjAction>();
-    return compiler->ExecuteAction(*act);
+// Writes s as a JSON string. raw_ostream::write_escaped() uses octal escapes,
+// which JSON doesn't have, and would mangle UTF-8.
+static void write_json_string(raw_ostream& os, StringRef s) {
+    os << '"';
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\')
+            os << '\\' << c;
+        else if (c < 0x20)
+            os << "\\u00" << hexdigit(c >> 4) << hexdigit(c & 15);
+        else
+            os << c;
+    }
+    os << '"';
+}
+
+// Chrome trace (chrome://tracing, Perfetto) of a single compile. This LLVM
+// predates -ftime-trace, so it's assembled from what is there: PPCallbacks
+// time each header, a TemplateInstantiationCallback times instantiations, and
+// the legacy pass manager's timers give each backend pass's total.
+struct TimeTrace {
+    using clock = std::chrono::steady_clock;
+
+    // Shorter events are dropped. The default matches
+    // -ftime-trace-granularity's and keeps boost-heavy traces loadable;
+    // --time-trace-granularity 0 keeps every instantiation, for
+    // template-stats.js.
+    static constexpr int64_t defaultGranularity = 500; // us
+    int64_t granularity = defaultGranularity;
+
+    // Separate rows in the viewer
+    enum Row { sourceRow = 1, templateRow, backendRow };
+
+    struct Event {
+        std::string name;
+        const char* category;
+        Row row;
+        int64_t begin;
+        int64_t duration;
+    };
+
+    clock::time_point start = clock::now();
+    std::vector<Event> events;
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   clock::now() - start)
+            .count();
+    }
+
+    void add(std::string name, const char* category, Row row, int64_t begin,
+             int64_t end) {
+        if (end - begin >= granularity)
+            events.push_back({std::move(name), category, row, begin,
+                              end - begin});
+    }
+
+    std::string json() const {
+        std::string result;
+        raw_string_ostream os{result};
+        os << "{\"traceEvents\":[";
+        const char* separator = "\n";
+        for (auto& event : events) {
+            os << separator << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << event.row
+               << ",\"ts\":" << event.begin << ",\"dur\":" << event.duration
+               << ",\"cat\":\"" << event.category << "\",\"name\":";
+            write_json_string(os, event.name);
+            os << "}";
+            separator = ",\n";
+        }
+        os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+        return os.str();
+    }
+};
+
+struct HeaderTimer : PPCallbacks {
+    TimeTrace& trace;
+    SourceManager& sourceManager;
+    std::vector<std::pair<std::string, int64_t>> open;
+
+    HeaderTimer(TimeTrace& trace, SourceManager& sourceManager)
+        : trace{trace}, sourceManager{sourceManager} {}
+
+    void FileChanged(SourceLocation loc, FileChangeReason reason,
+                     SrcMgr::CharacteristicKind fileType,
+                     FileID prevFID) override {
+        if (reason == EnterFile) {
+            auto presumed = sourceManager.getPresumedLoc(loc);
+            open.emplace_back(presumed.isValid() ? presumed.getFilename() : "",
+                              trace.now());
+        } else if (reason == ExitFile && !open.empty()) {
+            trace.add(std::move(open.back().first), "header",
+                      TimeTrace::sourceRow, open.back().second, trace.now());
+            open.pop_back();
+        }
+    }
+};
+
+struct TemplateTimer : TemplateInstantiationCallback {
+    TimeTrace& trace;
+    std::vector<int64_t> open;
+
+    TemplateTimer(TimeTrace& trace) : trace{trace} {}
+
+    void initialize(const Sema& sema) override {}
+    void finalize(const Sema& sema) override {}
+
+    void atTemplateBegin(const Sema& sema,
+                         const Sema::CodeSynthesisContext& inst) override {
+        open.push_back(trace.now());
+    }
+
+    void atTemplateEnd(const Sema& sema,
+                       const Sema::CodeSynthesisContext& inst) override {
+        if (open.empty())
+            return;
+        auto begin = open.back();
+        open.pop_back();
+        auto end = trace.now();
+        if (end - begin < trace.granularity)
+            return;
+        std::string name;
+        if (auto* decl = dyn_cast_or_null<NamedDecl>(inst.Entity)) {
+            raw_string_ostream os{name};
+            decl->getNameForDiagnostic(os, sema.getPrintingPolicy(), true);
+        }
+        trace.add(name.empty() ? "<unnamed>" : name, "instantiate",
+                  TimeTrace::templateRow, begin, end);
+    }
+};
+
+// LLVM's pass timers (TimePassesIsEnabled, TimerGroup) are process-wide. A
+// traced compile holds this exclusively while it uses them; every other
+// compile and LTO codegen holds it shared, so none runs while the timers are
+// on or being cleared.
+std::shared_mutex passTimersMutex;
+
+// EmitObjAction with TimeTrace's hooks installed
+struct TracedEmitObjAction : EmitObjAction {
+    TimeTrace& trace;
+
+    TracedEmitObjAction(TimeTrace& trace) : trace{trace} {}
+
+    void ExecuteAction() override {
+        std::unique_lock<std::shared_mutex> lock{passTimersMutex};
+
+        auto& compiler = getCompilerInstance();
+        compiler.getPreprocessor().addPPCallbacks(
+            std::make_unique<HeaderTimer>(trace,
+                                          compiler.getSourceManager()));
+        // ASTFrontendAction would create Sema later, too late to add the
+        // callback
+        if (!compiler.hasSema())
+            compiler.createSema(getTranslationUnitKind(), nullptr);
+        compiler.getSema().TemplateInstCallbacks.push_back(
+            std::make_unique<TemplateTimer>(trace));
+
+        TimerGroup::clearAll();
+        auto begin = trace.now();
+        TimePassesIsEnabled = true;
+        EmitObjAction::ExecuteAction();
+        TimePassesIsEnabled = false;
+        auto end = trace.now();
+        trace.add("Compile", "total", TimeTrace::sourceRow, begin, end);
+        add_pass_totals(end);
+
+        // Otherwise LLVM prints its own report at exit
+        TimerGroup::clearAll();
+    }
+
+    // The timers only have totals, so the passes are laid end to end,
+    // finishing when the compile did, in the order LLVM reports them
+    void add_pass_totals(int64_t end) {
+        std::string values;
+        raw_string_ostream os{values};
+        TimerGroup::printAllJSONValues(os, "");
+        os.flush();
+
+        std::vector<std::pair<std::string, int64_t>> passes;
+        int64_t total = 0;
+        StringRef rest = values;
+        while (!rest.empty()) {
+            StringRef line;
+            std::tie(line, rest) = rest.split('\n');
+            line = line.trim().rtrim(',');
+            if (!line.consume_front("\"time.pass."))
+                continue;
+            StringRef name, value;
+            std::tie(name, value) = line.split("\": ");
+            if (!name.consume_back(".wall"))
+                continue;
+            double seconds = 0;
+            if (value.getAsDouble(seconds))
+                continue;
+            passes.emplace_back(name, int64_t(seconds * 1'000'000));
+            total += passes.back().second;
+        }
+
+        auto begin = end - total;
+        trace.add("Backend", "backend", TimeTrace::backendRow, begin, end);
+        for (auto& [name, duration] : passes) {
+            trace.add(name, "pass", TimeTrace::backendRow, begin,
+                      begin + duration);
+            begin += duration;
+        }
+    }
+};
+
+// Compiles poll compile_cancelled() between top-level declarations and before
+// code generation; links poll it before each stage. A cancelled compile fails
+// with "compile cancelled", writes nothing to the compile cache, and leaves
+// the shared caches as they were. Native callers set the flag with
+// cancel_compile(); each compile or link entry point clears it through
+// begin_cancellable() before starting. The browser worker can't take
+// messages while compiling, so there the page's flag is read through
+// Module.compileCancelled (see process-clang.js).
+static std::atomic<bool> cancelRequested{false};
+
+extern "C" void cancel_compile(uint32_t cancel) { cancelRequested = cancel; }
+
+void begin_cancellable() { cancelRequested = false; }
+
+// pollPage false only checks cancelRequested. Reading the page's flag is a
+// call out to JS, which is too slow to make for every declaration.
+static bool compile_cancelled(bool pollPage = true) {
+#ifdef __EMSCRIPTEN__
+    if (pollPage && EM_ASM_INT({
+            return Module['compileCancelled'] && Module['compileCancelled']()
+                       ? 1
+                       : 0;
+        }))
+        return true;
+#endif
+    return cancelRequested;
+}
+
+void check_cancelled() {
+    if (compile_cancelled())
+        throw std::runtime_error("compile cancelled");
+}
+
+// Stops the parse at the next top-level declaration, and skips code
+// generation, once the compile is cancelled. The page's flag is only polled
+// every pagePollInterval declarations.
+struct CancellableConsumer : MultiplexConsumer {
+    using MultiplexConsumer::MultiplexConsumer;
+
+    static constexpr unsigned pagePollInterval = 256;
+    unsigned decls = 0;
+
+    bool HandleTopLevelDecl(DeclGroupRef group) override {
+        return !compile_cancelled(++decls % pagePollInterval == 0) &&
+               MultiplexConsumer::HandleTopLevelDecl(group);
+    }
+
+    void HandleTranslationUnit(ASTContext& context) override {
+        if (!compile_cancelled())
+            MultiplexConsumer::HandleTranslationUnit(context);
+    }
+};
+
+// Action with its ASTConsumer wrapped in CancellableConsumer
+template <typename Action> struct CancellableAction : Action {
+    using Action::Action;
+
+    std::unique_ptr<ASTConsumer>
+    CreateASTConsumer(CompilerInstance& compiler, StringRef inFile) override {
+        auto consumer = Action::CreateASTConsumer(compiler, inFile);
+        if (!consumer)
+            return nullptr;
+        std::vector<std::unique_ptr<ASTConsumer>> consumers;
+        consumers.push_back(std::move(consumer));
+        return std::make_unique<CancellableConsumer>(std::move(consumers));
+    }
+};
+
+// Matches the backend settings create_compiler() gives clang
+std::unique_ptr<TargetMachine> create_target_machine(bool optimize) {
+    std::string error;
+    auto target = TargetRegistry::lookupTarget(triple, error);
+    if (!target)
+        throw std::runtime_error(error);
+    TargetOptions options;
+    options.ThreadModel = ThreadModel::Single;
+    return std::unique_ptr<TargetMachine>{target->createTargetMachine(
+        triple, "", "", options, None, None,
+        optimize ? CodeGenOpt::Default : CodeGenOpt::None)};
+}
+
+// Splits an optimized module into up to partitions pieces and generates code
+// for each on its own thread. The split depends only on the module, and
+// locals stay with their users, so the objects link to the same contract
+// however the threads run. They're packed into archive in the cib-ar format;
+// see unpack_partitions().
+static void codegen_partitions(std::unique_ptr<llvm::Module> module,
+                               unsigned partitions, bool optimize,
+                               std::vector<uint8_t>& archive) {
+    if (!module)
+        throw std::runtime_error("no module to generate code for");
+    std::vector<SmallVector<char, 0>> buffers(partitions);
+    std::vector<std::unique_ptr<raw_svector_ostream>> streams;
+    std::vector<raw_pwrite_stream*> outputs;
+    for (auto& buffer : buffers) {
+        streams.push_back(std::make_unique<raw_svector_ostream>(buffer));
+        outputs.push_back(streams.back().get());
+    }
+    splitCodeGen(std::move(module), outputs, {},
+                 [&] { return create_target_machine(optimize); },
+                 TargetMachine::CGFT_ObjectFile, true);
+    archive.clear();
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        if (buffers[i].empty())
+            continue;
+        WasmTools::push_str(archive, "part" + std::to_string(i) + ".o");
+        WasmTools::push_leb5(archive, buffers[i].size());
+        archive.insert(archive.end(), buffers[i].begin(), buffers[i].end());
+    }
+}
+
+// Compiles inputFilename, as seen through fs, into object. Diagnostics go to
+// stderr if diagnostics is null. optimize false skips the LLVM optimizer.
+// trace, if not null, records where the time went; this bypasses the cache.
+// bitcode produces LLVM bitcode for lto_object() instead; it isn't traced.
+// partitions above 1 runs codegen_partitions() on the optimized module, and
+// object holds its archive; it doesn't apply with trace or bitcode.
+bool compile_object(const char* inputFilename, const char* sysDirs,
+                    IntrusiveRefCntPtr<vfs::FileSystem> fs,
+                    raw_ostream* diagnostics, std::vector<uint8_t>& object,
+                    bool optimize, TimeTrace* trace, bool bitcode,
+                    unsigned partitions) {
+    initialize_targets();
+    if (trace || bitcode)
+        partitions = 1;
+
+    std::string cacheFile;
+    if (!compileCacheDir.empty() && !trace) {
+        std::string key;
+        if (!get_cache_key(key, inputFilename, sysDirs, fs, diagnostics,
+                           optimize))
+            return false;
+        cacheFile = compileCacheDir + "/" + key +
+                    (bitcode ? ".bc"
+                     : partitions > 1 ? ".p" + std::to_string(partitions)
+                                      : ".o");
+        if (read_file(cacheFile, object))
+            return true;
+    }
+
+    auto compiler = create_compiler(inputFilename, "", sysDirs, fs,
+                                    diagnostics, optimize);
+    if (!*sysDirs)
+        use_pch(*compiler, inputFilename);
+    object.clear();
+    compiler->setOutputStream(std::make_unique<raw_vector_ostream>(object));
+    // Outlives act, which owns the module until takeModule()
+    std::optional<LLVMContext> partitionContext;
+    std::unique_ptr<FrontendAction> act;
+    if (partitions > 1)
+        act = std::make_unique<CancellableAction<EmitLLVMOnlyAction>>(
+            &partitionContext.emplace());
+    else if (bitcode) {
+        // Like -flto: leave whole-program work to lto_object()
+        compiler->getCodeGenOpts().PrepareForLTO = true;
+        act = std::make_unique<CancellableAction<EmitBCAction>>();
+    } else if (trace)
+        act = std::make_unique<CancellableAction<TracedEmitObjAction>>(*trace);
+    else
+        act = std::make_unique<CancellableAction<EmitObjAction>>();
+    // TracedEmitObjAction takes passTimersMutex exclusively itself
+    std::shared_lock<std::shared_mutex> timersLock{passTimersMutex,
+                                                   std::defer_lock};
+    if (!trace)
+        timersLock.lock();
+    if (!compiler->ExecuteAction(*act))
+        return false;
+    if (compile_cancelled()) {
+        (diagnostics ? *diagnostics : errs()) << "error: compile cancelled\n";
+        return false;
+    }
+    if (partitions > 1) {
+        try {
+            codegen_partitions(
+                static_cast<EmitLLVMOnlyAction&>(*act).takeModule(),
+                partitions, optimize, object);
+        } catch (std::exception& e) {
+            (diagnostics ? *diagnostics : errs())
+                << "error: " << e.what() << "\n";
+            return false;
+        }
+    }
+
+    if (!cacheFile.empty())
+        add_to_compile_cache(cacheFile, object);
+    return true;
+}
+
+static bool compile_file(const char* inputFilename,
+                         const char* outputFilename, const char* sysDirs,
+                         TimeTrace* trace, bool bitcode = false) {
+    begin_cancellable();
+    std::vector<uint8_t> object;
+    if (!compile_object(inputFilename, sysDirs, get_sysroot_file_system(),
+                        nullptr, object, true, trace, bitcode))
+        return false;
+    if (!write_file(outputFilename, object)) {
+        errs() << "error: unable to open output file '" << outputFilename
+               << "'\n";
+        return false;
+    }
+    return true;
+}
+
+extern "C" bool compile(const char* inputFilename, const char* outputFilename,
+                        const char* sysDirs) {
+    return compile_file(inputFilename, outputFilename, sysDirs, nullptr);
+}
+
+// --memory-stress: compiles inputFilename count times, bypassing the compile
+// cache, and fails if the heap grew by more than 5% after the first few.
+// Everything a compile allocates should be freed, and the caches kept
+// between compiles should be full once the input has been seen.
+static bool memory_stress(uint32_t count, const char* inputFilename) {
+    begin_cancellable();
+    const uint32_t warmup = 3;
+    auto savedCacheDir = std::move(compileCacheDir);
+    compileCacheDir.clear();
+    HeapStats stats{}, baseline{};
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < count; ++i) {
+        std::string diagnostics;
+        raw_string_ostream os{diagnostics};
+        std::vector<uint8_t> object;
+        ok = compile_object(inputFilename, "", get_sysroot_file_system(), &os,
+                            object);
+        os.flush();
+        if (!ok || !i)
+            errs() << diagnostics;
+        get_heap_stats(&stats);
+        if (i + 1 == std::min(warmup, count))
+            baseline = stats;
+        if ((i + 1) % 50 == 0)
+            printf("%u compiles: heap %u bytes, in use %u\n", i + 1,
+                   stats.heapSize, stats.inUse);
+    }
+    compileCacheDir = std::move(savedCacheDir);
+    if (!ok)
+        return false;
+    printf("heap: %u bytes after %u compiles, %u after %u\n"
+           "kept between compiles: %u sysroot entries, %u bytes cached, %u "
+           "bytes of preamble\n",
+           baseline.heapSize, std::min(warmup, count), stats.heapSize, count,
+           stats.sysrootEntries, stats.sysrootBytes, stats.preambleBytes);
+    if (stats.heapSize > baseline.heapSize + baseline.heapSize / 20) {
+        fprintf(stderr, "error: heap grew from %u to %u bytes\n",
+                baseline.heapSize, stats.heapSize);
+        return false;
+    }
+    return true;
+}
+
+// --time-trace's output
+static bool write_trace(const char* filename, const TimeTrace& trace) {
+    auto json = trace.json();
+    if (!write_file(filename, {json.begin(), json.end()})) {
+        errs() << "error: unable to open output file '" << filename << "'\n";
+        return false;
+    }
+    return true;
+}
+
+// Result of compile_buffer(). data, diagnostics and trace are owned by the
+// result; release all of it with free_compile_result(). trace is a Chrome
+// trace, or null if it wasn't asked for.
+struct CompileResult {
+    uint32_t ok;
+    uint32_t size;
+    uint8_t* data;
+    char* diagnostics;
+    char* trace;
+};
+
+// Name of the source in compile_buffer()'s diagnostics
+static const char bufferSourceName[] = "/source";
+
+// The sysroot with source at bufferSourceName
+static IntrusiveRefCntPtr<vfs::FileSystem>
+get_buffer_file_system(const char* source) {
+    auto memoryFs = make_intr<vfs::InMemoryFileSystem>();
+    memoryFs->addFile(bufferSourceName, 0,
+                      MemoryBuffer::getMemBufferCopy(source, bufferSourceName));
+    auto fs = make_intr<vfs::OverlayFileSystem>(get_sysroot_file_system());
+    fs->pushOverlay(memoryFs);
+    return fs;
+}
+
+static CompileResult* make_compile_result(bool ok,
+                                          const std::vector<uint8_t>& data,
+                                          const std::string& diagnostics,
+                                          const TimeTrace* trace) {
+    auto result = static_cast<CompileResult*>(malloc(sizeof(CompileResult)));
+    result->ok = ok;
+    result->size = ok ? data.size() : 0;
+    result->data = static_cast<uint8_t*>(malloc(result->size + 1));
+    memcpy(result->data, data.data(), result->size);
+    result->diagnostics = strdup(diagnostics.c_str());
+    result->trace = trace ? strdup(trace->json().c_str()) : nullptr;
+    return result;
+}
+
+// Like compile(), but the source comes from memory, the object goes to memory,
+// and diagnostics are returned instead of printed. optimize 0 gives a quick
+// unoptimized build. timeTrace 1 fills in the result's trace.
+extern "C" CompileResult* compile_buffer(const char* source,
+                                         const char* sysDirs,
+                                         uint32_t optimize,
+                                         uint32_t timeTrace) {
+    begin_cancellable();
+    std::string diagnostics;
+    raw_string_ostream os{diagnostics};
+    std::vector<uint8_t> object;
+    std::optional<TimeTrace> trace;
+    if (timeTrace)
+        trace.emplace();
+    auto ok = compile_object(bufferSourceName, sysDirs,
+                             get_buffer_file_system(source), &os, object,
+                             optimize, trace ? &*trace : nullptr);
+    os.flush();
+    return make_compile_result(ok, object, diagnostics,
+                               trace ? &*trace : nullptr);
+}
+
+extern "C" void free_compile_result(CompileResult* result) {
+    if (!result)
+        return;
+    free(result->data);
+    free(result->diagnostics);
+    free(result->trace);
+    free(result);
+}
+
+// Keeps diagnostics as data instead of text. Locations are resolved as they
+// arrive since the preamble's SourceManager is gone by the time the rest of
+// the file is parsed.
+struct DiagnosticCollector : DiagnosticConsumer {
+    struct Entry {
+        const char* severity;
+        std::string file;
+        unsigned line = 0;
+        unsigned column = 0;
+        std::string message;
+    };
+
+    std::vector<Entry> entries;
+
+    void HandleDiagnostic(DiagnosticsEngine::Level level,
+                          const Diagnostic& info) override {
+        DiagnosticConsumer::HandleDiagnostic(level, info);
+        static const char* const severities[] = {"ignored", "note", "remark",
+                                                 "warning", "error", "fatal"};
+        Entry entry{severities[level]};
+        SmallString<100> message;
+        info.FormatDiagnostic(message);
+        entry.message = message.str();
+        if (info.hasSourceManager() && info.getLocation().isValid()) {
+            auto presumed =
+                info.getSourceManager().getPresumedLoc(info.getLocation());
+            if (presumed.isValid()) {
+                entry.file = presumed.getFilename();
+                entry.line = presumed.getLine();
+                entry.column = presumed.getColumn();
+            }
+        }
+        entries.push_back(std::move(entry));
+    }
+
+    // [{"severity", "file", "line", "column", "message"}...]
+    static std::string json(const std::vector<Entry>& entries) {
+        std::string result;
+        raw_string_ostream os{result};
+        os << '[';
+        const char* separator = "\n";
+        for (auto& entry : entries) {
+            os << separator << "{\"severity\":\"" << entry.severity
+               << "\",\"file\":";
+            write_json_string(os, entry.file);
+            os << ",\"line\":" << entry.line << ",\"column\":" << entry.column
+               << ",\"message\":";
+            write_json_string(os, entry.message);
+            os << '}';
+            separator = ",\n";
+        }
+        os << "\n]\n";
+        return os.str();
+    }
+};
+
+struct NoPreambleCallbacks : PreambleCallbacks {
+    void AfterExecute(CompilerInstance& compiler) override {}
+    void AfterPCHEmitted(ASTWriter& writer) override {}
+    void HandleTopLevelDecl(DeclGroupRef group) override {}
+    void HandleMacroDefined(const Token& name,
+                            const MacroDirective* directive) override {}
+};
+
+// The preamble check_syntax() reuses while the source's leading includes,
+// the headers behind them, and sysDirs stay the same. Diagnostics inside
+// the preamble are only produced when it's built, so they're kept with it.
+// One bigger than syntaxPreambleLimit isn't kept; the browser's heap would
+// hold on to it after it's replaced.
+static const size_t syntaxPreambleLimit = 64 * 1024 * 1024;
+
+struct SyntaxPreamble {
+    std::string sysDirs;
+    PrecompiledPreamble preamble;
+    std::vector<DiagnosticCollector::Entry> diagnostics;
+};
+
+// Diagnostics only, fast enough to run as the user types. The preamble is
+// precompiled in memory on the first call; later calls parse only what
+// follows it. Returns ok (no errors) and, in diagnostics, the JSON from
+// DiagnosticCollector::json(); data is empty.
+extern "C" CompileResult* check_syntax(const char* source,
+                                       const char* sysDirs) {
+    static std::mutex mutex;
+    static std::optional<SyntaxPreamble> syntaxPreamble;
+    std::lock_guard<std::mutex> lock{mutex};
+
+    DiagnosticCollector collector;
+    auto fs = get_buffer_file_system(source);
+    auto compiler = create_compiler(bufferSourceName, "", sysDirs, fs);
+    compiler->createDiagnostics(&collector, false);
+    auto& invocation = compiler->getInvocation();
+    invocation.getFrontendOpts().ProgramAction = frontend::ParseSyntaxOnly;
+
+    auto buffer = MemoryBuffer::getMemBuffer(source, bufferSourceName);
+    auto bounds =
+        ComputePreambleBounds(invocation.getLangOpts(), buffer.get(), 0);
+    if (!syntaxPreamble || syntaxPreamble->sysDirs != sysDirs ||
+        !syntaxPreamble->preamble.CanReuse(invocation, buffer.get(), bounds,
+                                           fs.get())) {
+        syntaxPreamble.reset();
+        syntaxPreambleBytes = 0;
+        NoPreambleCallbacks callbacks;
+        auto preamble = PrecompiledPreamble::Build(
+            invocation, buffer.get(), bounds, compiler->getDiagnostics(), fs,
+            std::make_shared<PCHContainerOperations>(), true, callbacks);
+        // Without a preamble the whole file is parsed, which reports these
+        // again
+        auto diagnostics = std::move(collector.entries);
+        collector.entries.clear();
+        compiler->getDiagnostics().Reset();
+        if (preamble && preamble->getSize() <= syntaxPreambleLimit) {
+            syntaxPreambleBytes = preamble->getSize();
+            syntaxPreamble.emplace(SyntaxPreamble{
+                sysDirs, std::move(*preamble), std::move(diagnostics)});
+        }
+    }
+
+    std::vector<DiagnosticCollector::Entry> entries;
+    if (syntaxPreamble) {
+        syntaxPreamble->preamble.AddImplicitPreamble(invocation, fs,
+                                                     buffer.get());
+        compiler->setVirtualFileSystem(fs);
+        entries = syntaxPreamble->diagnostics;
+    }
+    SyntaxOnlyAction act;
+    compiler->ExecuteAction(act);
+    entries.insert(entries.end(), collector.entries.begin(),
+                   collector.entries.end());
+    auto ok = std::none_of(entries.begin(), entries.end(), [](auto& entry) {
+        return entry.severity == "error"s || entry.severity == "fatal"s;
+    });
+    return make_compile_result(ok, {}, DiagnosticCollector::json(entries),
+                               nullptr);
+}
+
+struct BatchOutput {
+    bool ok = false;
+    std::vector<uint8_t> object;
+    std::string diagnostics;
+};
+
+// Compiles each input into its own object, spread over parallel_for(). The
+// sysroot file cache and PCHs are shared by all of them. Diagnostics are
+// printed in input order once everything finishes. bitcode is as in
+// compile_object().
+static std::vector<BatchOutput>
+compile_objects(const std::vector<std::string>& inputFilenames,
+                const char* sysDirs, bool bitcode = false) {
+    begin_cancellable();
+    initialize_targets();
+    std::vector<BatchOutput> outputs(inputFilenames.size());
+    parallel_for(inputFilenames.size(), [&](size_t i) {
+        raw_string_ostream os{outputs[i].diagnostics};
+        outputs[i].ok = compile_object(
+            inputFilenames[i].c_str(), sysDirs, get_sysroot_file_system(),
+            &os, outputs[i].object, true, nullptr, bitcode);
+    });
+    for (auto& output : outputs)
+        errs() << output.diagnostics;
+    return outputs;
+}
+
+// inputFilenames and outputFilenames are ':'-separated lists of equal length
+extern "C" bool compile_batch(const char* inputFilenames,
+                              const char* outputFilenames,
+                              const char* sysDirs) {
+    auto inputs = split_list(inputFilenames);
+    auto outputs = split_list(outputFilenames);
+    if (inputs.size() != outputs.size()) {
+        errs() << "error: compile_batch needs one output per input\n";
+        return false;
+    }
+    auto objects = compile_objects(inputs, sysDirs);
+    bool ok = true;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (!objects[i].ok) {
+            ok = false;
+        } else if (!write_file(outputs[i], objects[i].object)) {
+            errs() << "error: unable to open output file '" << outputs[i]
+                   << "'\n";
+            ok = false;
+        }
+    }
+    return ok;
 }
 #endif
 
 #ifdef FAKE_COMPILE
-extern "C" bool compile(const char* inputFilename, const char* outputFilename) {
+extern "C" void set_compile_cache(const char* dir) {}
+
+extern "C" bool compile(const char* inputFilename, const char* outputFilename,
+                        const char* sysDirs) {
     puts(STRX(LIB_PREFIX) "include");
     printf("in:  %s\n", inputFilename);
     printf("out: %s\n", outputFilename);
@@ -188,45 +1106,160 @@ extern "C" bool compile(const char* inputFilename, const char* outputFilename) {
     }
     return true;
 }
-#endif
+
+int main(int argc, const char* argv[]) {
+    if (argc == 3)
+        return !compile(argv[1], argv[2], "");
+    if (argc > 1) {
+        fprintf(stderr, "Usage: input_file.cpp output_file.wasm\n");
+        return 1;
+    }
+    return 0;
+}
+
+#else // FAKE_COMPILE
 
 #ifdef EOS_CLANG
-extern "C" bool link_wasm(const char* prelinkedFile, const char* linkedFile,
-                          uint32_t stackSize) {
+std::unique_ptr<WasmTools::Module>
+read_object(const std::string& filename, std::vector<uint8_t> binary) {
+    auto module = make_unique<WasmTools::Module>();
+    module->filename = filename;
+    module->binary = std::move(binary);
     try {
-        WasmTools::Linked linked;
+        read_module(*module);
+    } catch (std::exception& e) {
+        throw std::runtime_error(filename + ": "s + e.what());
+    }
+    return module;
+}
+
+// rtl-eos as read_object() leaves it, read once and shared by every link.
+// Nothing may link these; linking modifies modules, so add_rtl_eos() gives
+// each link its own clone_module() copies.
+static const std::vector<std::unique_ptr<WasmTools::Module>>& rtl_eos() {
+    static const auto modules = [] {
         auto archive =
-            WasmTools::File{STRX(LIB_PREFIX) "build/rtl-eos/rtl-eos", "rb"}
-                .read();
+            read_sysroot_file(STRX(LIB_PREFIX) "build/rtl-eos/rtl-eos");
+        std::vector<std::unique_ptr<WasmTools::Module>> modules;
         size_t pos = 0;
         while (pos < archive.size()) {
             auto sv = WasmTools::read_str(archive, pos);
             std::string name{begin(sv), end(sv)};
             auto size = WasmTools::read_leb(archive, pos);
-            auto module = make_unique<WasmTools::Module>();
-            module->filename = name;
-            module->binary.insert(module->binary.end(), archive.begin() + pos,
-                                  archive.begin() + pos + size);
-            try {
-                read_module(*module);
-            } catch (std::exception& e) {
-                throw std::runtime_error(name + ": "s + e.what());
-            }
-            linked.modules.push_back(move(module));
+            modules.push_back(
+                read_object(name, {archive.begin() + pos,
+                                   archive.begin() + pos + size}));
             pos += size;
         }
+        return modules;
+    }();
+    return modules;
+}
 
-        auto module = make_unique<WasmTools::Module>();
-        module->filename = prelinkedFile;
-        module->binary = WasmTools::File{prelinkedFile, "rb"}.read();
-        try {
-            read_module(*module);
-        } catch (std::exception& e) {
-            throw std::runtime_error(prelinkedFile + ": "s + e.what());
+void add_rtl_eos(WasmTools::Linked& linked) {
+    for (auto& module : rtl_eos())
+        linked.modules.push_back(WasmTools::clone_module(*module));
+}
+
+// Splits an object compile_object() made with partitions back into its
+// parts; anything else is a single wasm object
+static std::vector<std::pair<std::string, std::vector<uint8_t>>>
+unpack_partitions(const std::string& name, std::vector<uint8_t> object) {
+    std::vector<std::pair<std::string, std::vector<uint8_t>>> parts;
+    if (object.size() >= 4 && !memcmp(object.data(), "\0asm", 4)) {
+        parts.emplace_back(name, std::move(object));
+        return parts;
+    }
+    for (size_t pos = 0; pos < object.size();) {
+        auto sv = WasmTools::read_str(object, pos);
+        std::string partName = name + ":" + std::string{begin(sv), end(sv)};
+        auto size = WasmTools::read_leb(object, pos);
+        if (pos + size > object.size())
+            throw std::runtime_error(name + ": partitions truncated");
+        parts.emplace_back(std::move(partName),
+                           std::vector<uint8_t>{object.begin() + pos,
+                                                object.begin() + pos + size});
+        pos += size;
+    }
+    return parts;
+}
+
+// Adds the contract's objects to linked, or with lto the single object
+// lto_object() makes from them. Returns the contract's modules.
+std::vector<WasmTools::Module*>
+add_contract(WasmTools::Linked& linked,
+             std::vector<std::pair<std::string, std::vector<uint8_t>>> objects,
+             bool lto, bool optimize, uint32_t shrinkLevel) {
+    std::vector<WasmTools::Module*> contract;
+    if (lto) {
+        linked.modules.push_back(
+            lto_object(std::move(objects), optimize, shrinkLevel));
+        contract.push_back(linked.modules.back().get());
+    } else {
+        for (auto& [name, object] : objects) {
+            for (auto& [partName, part] :
+                 unpack_partitions(name, std::move(object))) {
+                linked.modules.push_back(read_object(partName, std::move(part)));
+                contract.push_back(linked.modules.back().get());
+            }
         }
-        linked.modules.push_back(move(module));
+    }
+    return contract;
+}
+
+// Links the contract's modules, which must already be in linked.modules,
+// against rtl-eos. optimizeLevel 0 skips the optimizer. The stack report is
+// appended to log rather than printed so contracts can link in parallel.
+// instrument 1 counts calls per function, 2 also times them, like cib-link
+// --instrument and --instrument-time; the contract then exports
+// __cib_profile, and with timing imports __cib_clock.
+void link_contract(WasmTools::Linked& linked,
+                   const std::vector<WasmTools::Module*>& contract,
+                   uint32_t stackSize, uint32_t optimizeLevel,
+                   uint32_t shrinkLevel, std::string& log,
+                   uint32_t instrument) {
+    linked.instrument = instrument >= 1;
+    linked.instrument_time = instrument >= 2;
+    // A contract is the whole program, so nothing else can add to its
+    // table
+    linked.devirtualize = true;
+    linked.drop_unused_elements = true;
+    linked.auto_stack_size = true;
+    check_cancelled();
+    linkEos(linked, contract, stackSize);
+    raw_string_ostream os{log};
+    if (linked.stack_bound)
+        os << "stack: " << *linked.stack_bound << " bytes"
+           << (linked.has_indirect_calls
+                   ? " (indirect calls assumed to reach any table entry "
+                     "of their type)"
+                   : "")
+           << "\n";
+    else
+        os << "stack: unbounded ("
+           << (linked.has_recursion ? "recursion" : "dynamic allocation")
+           << "); reserved " << stackSize << " bytes\n";
+    os.flush();
+    if (optimizeLevel) {
+        check_cancelled();
+        WasmTools::optimize(linked.binary, {optimizeLevel, shrinkLevel});
+    }
+}
 
-        linkEos(linked, *linked.modules.back(), stackSize);
+// optimizeLevel 0 skips the optimizer
+extern "C" bool link_wasm(const char* prelinkedFile, const char* linkedFile,
+                          uint32_t stackSize, uint32_t optimizeLevel,
+                          uint32_t shrinkLevel) {
+    begin_cancellable();
+    try {
+        WasmTools::Linked linked;
+        add_rtl_eos(linked);
+        linked.modules.push_back(read_object(
+            prelinkedFile, WasmTools::File{prelinkedFile, "rb"}.read()));
+        std::string log;
+        link_contract(linked, {linked.modules.back().get()}, stackSize,
+                      optimizeLevel, shrinkLevel, log);
+        fputs(log.c_str(), stdout);
         WasmTools::File{linkedFile, "wb"}.write(linked.binary);
         return true;
     } catch (std::exception& e) {
@@ -235,27 +1268,296 @@ extern "C" bool link_wasm(const char* prelinkedFile, const char* linkedFile,
     }
 }
 
-int main(int argc, const char* argv[]) {
-    if (argc == 4) {
-        if (!compile(argv[1], argv[2], ""))
+// Compiles and links a single-file contract without touching the file
+// system: the object moves straight into the Module which linkEos() reads.
+// optimize 0 skips the LLVM optimizer; optimizeLevel 0 skips binaryen. The
+// result holds the linked contract. timeTrace 1 traces the compile; the link
+// shows up as a single event. lto 1 compiles to bitcode and optimizes it
+// together with rtl-eos; see lto_object().
+extern "C" CompileResult*
+compile_link_buffer(const char* source, const char* sysDirs, uint32_t optimize,
+                    uint32_t stackSize, uint32_t optimizeLevel,
+                    uint32_t shrinkLevel, uint32_t timeTrace, uint32_t lto) {
+    begin_cancellable();
+    std::string diagnostics;
+    raw_string_ostream os{diagnostics};
+    std::vector<uint8_t> object;
+    std::optional<TimeTrace> trace;
+    if (timeTrace)
+        trace.emplace();
+    auto traced = trace ? &*trace : nullptr;
+    if (!compile_object(bufferSourceName, sysDirs,
+                        get_buffer_file_system(source), &os, object, optimize,
+                        traced, lto)) {
+        os.flush();
+        return make_compile_result(false, {}, diagnostics, traced);
+    }
+    auto linkBegin = trace ? trace->now() : 0;
+    try {
+        WasmTools::Linked linked;
+        add_rtl_eos(linked);
+        auto contract =
+            add_contract(linked, {{bufferSourceName, std::move(object)}}, lto,
+                         optimize, shrinkLevel);
+        std::string log;
+        link_contract(linked, contract, stackSize, optimizeLevel, shrinkLevel,
+                      log);
+        fputs(log.c_str(), stdout);
+        if (trace)
+            trace->add("Link", "link", TimeTrace::backendRow, linkBegin,
+                       trace->now());
+        os.flush();
+        return make_compile_result(true, linked.binary, diagnostics, traced);
+    } catch (std::exception& e) {
+        os << "error: " << e.what() << "\n";
+        os.flush();
+        return make_compile_result(false, {}, diagnostics, traced);
+    }
+}
+
+// The command-line version of compile_link_buffer(). prelinkedFile is still
+// written for inspection, but the link reads the object from memory. With
+// lto, prelinkedFile is lto_object()'s output. partitions is as in
+// compile_object(); prelinkedFile then holds the partitions' archive.
+// instrument is as in link_contract().
+static bool compile_link_file(const char* inputFilename,
+                              const char* prelinkedFile,
+                              const char* linkedFile, uint32_t stackSize,
+                              uint32_t optimizeLevel, uint32_t shrinkLevel,
+                              TimeTrace* trace, bool lto,
+                              unsigned partitions = 1,
+                              uint32_t instrument = 0) {
+    begin_cancellable();
+    std::vector<uint8_t> object;
+    if (!compile_object(inputFilename, "", get_sysroot_file_system(), nullptr,
+                        object, true, trace, lto, partitions))
+        return false;
+    try {
+        if (!lto)
+            WasmTools::File{prelinkedFile, "wb"}.write(object);
+        WasmTools::Linked linked;
+        add_rtl_eos(linked);
+        auto contract = add_contract(
+            linked, {{inputFilename, std::move(object)}}, lto, true,
+            shrinkLevel);
+        if (lto)
+            WasmTools::File{prelinkedFile, "wb"}.write(contract[0]->binary);
+        std::string log;
+        link_contract(linked, contract, stackSize, optimizeLevel, shrinkLevel,
+                      log, instrument);
+        fputs(log.c_str(), stdout);
+        WasmTools::File{linkedFile, "wb"}.write(linked.binary);
+        return true;
+    } catch (std::exception& e) {
+        printf("error: %s\n", e.what());
+        return false;
+    }
+}
+
+// Compiles a multi-file contract (inputFilenames is ':'-separated) and links
+// the objects without writing them out. lto 1 optimizes the files together
+// with rtl-eos; see lto_object().
+extern "C" bool compile_link_batch(const char* inputFilenames,
+                                   const char* linkedFile, uint32_t stackSize,
+                                   uint32_t optimizeLevel,
+                                   uint32_t shrinkLevel, uint32_t lto) {
+    auto inputs = split_list(inputFilenames);
+    auto objects = compile_objects(inputs, "", lto);
+    for (auto& object : objects)
+        if (!object.ok)
+            return false;
+    try {
+        WasmTools::Linked linked;
+        add_rtl_eos(linked);
+        std::vector<std::pair<std::string, std::vector<uint8_t>>> parts;
+        for (size_t i = 0; i < inputs.size(); ++i)
+            parts.emplace_back(inputs[i], std::move(objects[i].object));
+        auto contract = add_contract(linked, std::move(parts), lto,
+                                     true, shrinkLevel);
+        std::string log;
+        link_contract(linked, contract, stackSize, optimizeLevel, shrinkLevel,
+                      log);
+        fputs(log.c_str(), stdout);
+        WasmTools::File{linkedFile, "wb"}.write(linked.binary);
+        return true;
+    } catch (std::exception& e) {
+        printf("error: %s\n", e.what());
+        return false;
+    }
+}
+
+// Parses -O0..-O4, -Os or -Oz
+bool parse_optimize_level(StringRef arg, uint32_t& optimizeLevel,
+                          uint32_t& shrinkLevel) {
+    auto level = arg.drop_front(2);
+    if (level == "s") {
+        optimizeLevel = 2;
+        shrinkLevel = 1;
+    } else if (level == "z") {
+        optimizeLevel = 2;
+        shrinkLevel = 2;
+    } else if (level.size() == 1 && level[0] >= '0' && level[0] <= '4') {
+        optimizeLevel = level[0] - '0';
+        shrinkLevel = 0;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+int run(int argc, const char* argv[]) {
+    if (argc == 4 && argv[1] == "--pch"s)
+        return !generate_pch(argv[2], argv[3]);
+    if (argc == 4 && argv[1] == "--emit-llvm"s)
+        return !compile_file(argv[2], argv[3], "", nullptr, true);
+    if (argc == 4 && argv[1] == "--memory-stress"s)
+        return !memory_stress(atoi(argv[2]), argv[3]);
+    if (argc == 3 && argv[1] == "--manifest"s)
+        return !build_manifest(argv[2]);
+    uint32_t optimizeLevel = 0, shrinkLevel = 0;
+    if (argc > 1 && argv[1][0] == '-' && argv[1][1] == 'O') {
+        if (!parse_optimize_level(argv[1], optimizeLevel, shrinkLevel)) {
+            fprintf(stderr, "Unknown optimization level %s\n", argv[1]);
             return 1;
-        if (!link_wasm(argv[2], argv[3], 16 * 1024))
+        }
+        ++argv;
+        --argc;
+    }
+    bool lto = false;
+    if (argc > 1 && argv[1] == "--lto"s) {
+        lto = true;
+        ++argv;
+        --argc;
+    }
+    unsigned partitions = 1;
+    if (argc >= 3 && argv[1] == "--partitions"s) {
+        partitions = atoi(argv[2]);
+        if (!partitions) {
+            fprintf(stderr, "Invalid partition count %s\n", argv[2]);
             return 1;
-    } else if (argc > 1) {
-        fprintf(stderr, "Usage: input_file.cpp prelinked.wasm linked.wasm\n");
+        }
+        argv += 2;
+        argc -= 2;
+    }
+    uint32_t instrument = 0;
+    if (argc > 1 && (argv[1] == "--instrument"s ||
+                     argv[1] == "--instrument-time"s)) {
+        instrument = argv[1] == "--instrument"s ? 1 : 2;
+        ++argv;
+        --argc;
+    }
+    const char* traceFile = nullptr;
+    int64_t traceGranularity = TimeTrace::defaultGranularity;
+    if (argc >= 3 && argv[1] == "--time-trace"s) {
+        traceFile = argv[2];
+        argv += 2;
+        argc -= 2;
+        if (argc >= 3 && argv[1] == "--time-trace-granularity"s) {
+            traceGranularity = atoi(argv[2]);
+            argv += 2;
+            argc -= 2;
+        }
+    }
+    if (argc >= 4 && argv[1] == "--batch"s && instrument) {
+        fprintf(stderr, "--instrument and --instrument-time can't be used "
+                        "with --batch\n");
+        return 1;
+    }
+    if (argc >= 4 && argv[1] == "--batch"s && !traceFile) {
+        std::string inputs;
+        for (int i = 3; i < argc; ++i)
+            inputs += argv[i] + ":"s;
+        if (!compile_link_batch(inputs.c_str(), argv[2], 16 * 1024,
+                                optimizeLevel, shrinkLevel, lto))
+            return 1;
+    } else if (argc == 4) {
+        std::optional<TimeTrace> trace;
+        if (traceFile)
+            trace.emplace().granularity = traceGranularity;
+        auto begin = trace ? trace->now() : 0;
+        if (!compile_link_file(argv[1], argv[2], argv[3], 16 * 1024,
+                               optimizeLevel, shrinkLevel,
+                               trace ? &*trace : nullptr, lto, partitions,
+                               instrument))
+            return 1;
+        if (trace) {
+            trace->add("Compile and link", "total", TimeTrace::sourceRow,
+                       begin, trace->now());
+            if (!write_trace(traceFile, *trace))
+                return 1;
+        }
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: [-O0..-O4|-Os|-Oz] [--lto] [--partitions n] "
+                        "[--instrument|--instrument-time] "
+                        "[--time-trace trace.json [--time-trace-granularity "
+                        "us]] input_file.cpp prelinked.wasm linked.wasm\n"
+                        "       [-O0..-O4|-Os|-Oz] [--lto] --batch linked.wasm "
+                        "input_file.cpp...\n"
+                        "       --manifest contracts.txt\n"
+                        "       --emit-llvm input_file.cpp output_file.bc\n"
+                        "       --memory-stress count input_file.cpp\n"
+                        "       --pch header_set.h output.pch\n"
+                        "       --server [socket]\n");
         return 1;
     }
     return 0;
 }
 
 #else
-int main(int argc, const char* argv[]) {
+int run(int argc, const char* argv[]) {
+    if (argc == 4 && argv[1] == "--pch"s)
+        return !generate_pch(argv[2], argv[3]);
+    if (argc == 4 && argv[1] == "--emit-llvm"s)
+        return !compile_file(argv[2], argv[3], "", nullptr, true);
+    if (argc == 4 && argv[1] == "--memory-stress"s)
+        return !memory_stress(atoi(argv[2]), argv[3]);
+    if ((argc == 5 ||
+         (argc == 7 && argv[3] == "--time-trace-granularity"s)) &&
+        argv[1] == "--time-trace"s) {
+        TimeTrace trace;
+        if (argc == 7)
+            trace.granularity = atoi(argv[4]);
+        return !compile_file(argv[argc - 2], argv[argc - 1], "", &trace) ||
+               !write_trace(argv[2], trace);
+    }
     if (argc == 3)
         return !compile(argv[1], argv[2], "");
+    if (argc >= 4 && argc % 2 == 0 && argv[1] == "--batch"s) {
+        std::string inputs, outputs;
+        for (int i = 2; i < argc; i += 2) {
+            inputs += argv[i] + ":"s;
+            outputs += argv[i + 1] + ":"s;
+        }
+        return !compile_batch(inputs.c_str(), outputs.c_str(), "");
+    }
     if (argc > 1) {
-        fprintf(stderr, "Usage: input_file.cpp output_file.wasm\n");
+        fprintf(stderr, "Usage: [--time-trace trace.json "
+                        "[--time-trace-granularity us]] input_file.cpp "
+                        "output_file.wasm\n"
+                        "       --batch input_file.cpp output_file.wasm "
+                        "[input_file.cpp output_file.wasm]...\n"
+                        "       --emit-llvm input_file.cpp output_file.bc\n"
+                        "       --memory-stress count input_file.cpp\n"
+                        "       --pch header_set.h output.pch\n"
+                        "       --server [socket]\n");
         return 1;
     }
     return 0;
 }
 #endif
+
+int main(int argc, const char* argv[]) {
+    if (auto dir = getenv("CIB_COMPILE_CACHE"))
+        set_compile_cache(dir);
+    if (auto archive = getenv("CIB_SYSROOT_ARCHIVE"))
+        if (!mount_archive_file(archive, STRX(LIB_PREFIX)))
+            return 1;
+    if (auto header = getenv("CIB_EXTERN_TEMPLATES"))
+        externTemplates = header;
+#ifndef __EMSCRIPTEN__
+    if ((argc == 2 || argc == 3) && argv[1] == "--server"s)
+        return serve(argc == 3 ? argv[2] : nullptr);
+#endif
+    return run(argc, argv);
+}
+#endif // FAKE_COMPILE
@@ -0,0 +1,288 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Shared by the files which make up clang and clang-eos: clang.cpp, which
+// has the compile API and main(), and the clang-*.cpp modules. With
+// FAKE_COMPILE only clang.cpp's stand-in compile() is built; the modules
+// are empty.
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "clang/Basic/VirtualFileSystem.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "wasm-tools.h"
+
+using namespace llvm;
+using namespace clang;
+using namespace std::literals;
+
+#define STRX(s) STR(s)
+#define STR(s) #s
+
+// Header sets (*.h) and their precompiled headers (*.pch); see build.py --pch
+#ifdef PCH_DIR
+inline const char pchDir[] = STRX(PCH_DIR);
+#else
+inline const char pchDir[] = STRX(LIB_PREFIX) "pch/";
+#endif
+
+template <typename T, typename... A> IntrusiveRefCntPtr<T> make_intr(A&&... a) {
+    return {new T{std::forward<A>(a)...}};
+}
+
+inline const char* const triple = "wasm32-unknown-unknown-wasm";
+
+// A view of a buffer which keeps it alive, so a cache can drop its entry
+// while a compile still has the file open
+class SharedBuffer : public MemoryBuffer {
+    std::shared_ptr<const MemoryBuffer> owner;
+
+  public:
+    SharedBuffer(std::shared_ptr<const MemoryBuffer> owner,
+                 bool requiresNullTerminator)
+        : owner{std::move(owner)} {
+        init(this->owner->getBufferStart(), this->owner->getBufferEnd(),
+             requiresNullTerminator);
+    }
+
+    StringRef getBufferIdentifier() const override {
+        return owner->getBufferIdentifier();
+    }
+
+    BufferKind getBufferKind() const override {
+        return owner->getBufferKind();
+    }
+};
+
+// A file served from memory
+struct CachedFile : vfs::File {
+    vfs::Status fileStatus;
+    std::shared_ptr<const MemoryBuffer> content;
+
+    CachedFile(const vfs::Status& fileStatus,
+               std::shared_ptr<const MemoryBuffer> content)
+        : fileStatus{fileStatus}, content{std::move(content)} {}
+
+    ErrorOr<vfs::Status> status() override { return fileStatus; }
+
+    ErrorOr<std::unique_ptr<MemoryBuffer>>
+    getBuffer(const Twine& name, int64_t fileSize, bool requiresNullTerminator,
+              bool isVolatile) override {
+        return std::unique_ptr<MemoryBuffer>{
+            std::make_unique<SharedBuffer>(content, requiresNullTerminator)};
+    }
+
+    std::error_code close() override { return {}; }
+};
+
+// Like raw_svector_ostream, but for the std::vector<uint8_t> WasmTools uses,
+// so objects can go straight into a Module
+class raw_vector_ostream : public raw_pwrite_stream {
+    std::vector<uint8_t>& vec;
+
+    void write_impl(const char* ptr, size_t size) override {
+        vec.insert(vec.end(), ptr, ptr + size);
+    }
+
+    void pwrite_impl(const char* ptr, size_t size, uint64_t offset) override {
+        memcpy(vec.data() + offset, ptr, size);
+    }
+
+    uint64_t current_pos() const override { return vec.size(); }
+
+  public:
+    explicit raw_vector_ostream(std::vector<uint8_t>& vec)
+        : raw_pwrite_stream{true}, vec{vec} {}
+};
+
+// Runs f(0) to f(n - 1) over a thread pool. The browser has no threads so
+// they run in order.
+template <typename F> void parallel_for(size_t n, F f) {
+#ifdef __EMSCRIPTEN__
+    for (size_t i = 0; i < n; ++i)
+        f(i);
+#else
+    std::atomic<size_t> next{0};
+    auto numThreads =
+        std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1u), n);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < numThreads; ++t)
+        threads.emplace_back([&] {
+            for (size_t i; (i = next++) < n;)
+                f(i);
+        });
+    for (auto& thread : threads)
+        thread.join();
+#endif
+}
+
+// clang-sysroot.cpp
+
+// The file system every compile reads the sysroot through
+IntrusiveRefCntPtr<vfs::FileSystem> get_sysroot_file_system();
+
+// Lays fs over the sysroot file system, serving paths under mountPoint. Not
+// while compiling.
+void mount_sysroot(IntrusiveRefCntPtr<vfs::FileSystem> fs,
+                   StringRef mountPoint);
+
+// Entries, including misses, and the bytes of file content cached
+std::pair<size_t, size_t> get_sysroot_cache_size();
+
+// Throws if filename can't be read
+std::vector<uint8_t> read_sysroot_file(const char* filename);
+
+// clang-zip.cpp
+
+// Mount a zip read-only at mountPoint, over the sysroot file system.
+// mount_archive() takes ownership of data, which must come from malloc().
+extern "C" bool mount_archive(const char* mountPoint, uint8_t* data,
+                              uint32_t size);
+extern "C" bool mount_archive_file(const char* filename,
+                                   const char* mountPoint);
+
+// clang-cache.cpp
+
+// Where compile_object() keeps objects by get_cache_key(). Empty disables
+// the compile cache.
+extern std::string compileCacheDir;
+
+extern "C" void set_compile_cache(const char* dir);
+
+// Hashes the compiler build, the options, and the preprocessed source.
+// False if preprocessing failed.
+bool get_cache_key(std::string& key, const char* inputFilename,
+                   const char* sysDirs, IntrusiveRefCntPtr<vfs::FileSystem> fs,
+                   raw_ostream* diagnostics, bool optimize);
+
+// Stores object as cacheFile, then trims the cache to its limit
+void add_to_compile_cache(const std::string& cacheFile,
+                          const std::vector<uint8_t>& object);
+
+// clang-pch.cpp
+
+// Has compiler use the largest header set in pchDir which inputFilename
+// includes in full before anything else, if there is one
+void use_pch(CompilerInstance& compiler, const char* inputFilename);
+
+// --pch: precompiles a header set
+bool generate_pch(const char* headerFilename, const char* pchFilename);
+
+// clang.cpp
+
+void initialize_targets();
+
+// Sets up a compile for the sysroot. Diagnostics go to stderr if
+// diagnostics is null. optimize false skips the LLVM optimizer.
+std::unique_ptr<CompilerInstance>
+create_compiler(const char* inputFilename, const char* outputFilename,
+                const char* sysDirs,
+                IntrusiveRefCntPtr<vfs::FileSystem> fs = get_sysroot_file_system(),
+                raw_ostream* diagnostics = nullptr, bool optimize = true);
+
+bool read_file(const std::string& filename, std::vector<uint8_t>& content);
+bool write_file(const std::string& filename,
+                const std::vector<uint8_t>& content);
+
+// The command line, less --server; see main()
+int run(int argc, const char* argv[]);
+
+// Guards LLVM's process-wide pass timers, which a traced compile holds
+// exclusively; other compiles and LTO codegen hold it shared
+extern std::shared_mutex passTimersMutex;
+
+// Each compile or link entry point calls this before starting
+void begin_cancellable();
+
+// Throws "compile cancelled" once cancel_compile() or the page asks
+void check_cancelled();
+
+// Matches the backend settings create_compiler() gives clang
+std::unique_ptr<TargetMachine> create_target_machine(bool optimize);
+
+struct TimeTrace;
+
+// Compiles inputFilename, as seen through fs, into object; see the
+// definition for the options
+bool compile_object(const char* inputFilename, const char* sysDirs,
+                    IntrusiveRefCntPtr<vfs::FileSystem> fs,
+                    raw_ostream* diagnostics, std::vector<uint8_t>& object,
+                    bool optimize = true, TimeTrace* trace = nullptr,
+                    bool bitcode = false, unsigned partitions = 1);
+
+#ifdef EOS_CLANG
+// Reads a wasm object; errors name filename
+std::unique_ptr<WasmTools::Module> read_object(const std::string& filename,
+                                               std::vector<uint8_t> binary);
+
+// Parses -O0..-O4, -Os or -Oz
+bool parse_optimize_level(StringRef arg, uint32_t& optimizeLevel,
+                          uint32_t& shrinkLevel);
+
+// Gives linked its own copy of rtl-eos
+void add_rtl_eos(WasmTools::Linked& linked);
+
+// Adds the contract's objects to linked; returns the contract's modules
+std::vector<WasmTools::Module*>
+add_contract(WasmTools::Linked& linked,
+             std::vector<std::pair<std::string, std::vector<uint8_t>>> objects,
+             bool lto, bool optimize, uint32_t shrinkLevel);
+
+// Links the contract against rtl-eos, appending the stack report to log
+void link_contract(WasmTools::Linked& linked,
+                   const std::vector<WasmTools::Module*>& contract,
+                   uint32_t stackSize, uint32_t optimizeLevel,
+                   uint32_t shrinkLevel, std::string& log,
+                   uint32_t instrument = 0);
+
+// clang-lto.cpp
+
+// Link-time optimization of a contract's bitcode and the rtl-eos bitcode it
+// reaches, into one object
+std::unique_ptr<WasmTools::Module>
+lto_object(std::vector<std::pair<std::string, std::vector<uint8_t>>> inputs,
+           bool optimize, uint32_t shrinkLevel);
+
+// clang-manifest.cpp
+
+// --manifest: builds every contract the manifest lists, in parallel
+bool build_manifest(const char* filename);
+#endif
+
+#ifndef __EMSCRIPTEN__
+// clang-server.cpp
+
+// --server: runs jobs from stdin, or from connections to socketPath if it's
+// not null, until the client goes away
+int serve(const char* socketPath);
+#endif
@@ -0,0 +1,98 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Checks that the emscripten build of clang or clang-eos doesn't grow its heap
+// as it keeps compiling, like the native build's --memory-stress. Mounts the
+// sysroot from its zip, runs compile_buffer() on source count times (500 by
+// default), and fails if get_heap_stats()'s heapSize grew by more than 5%
+// after the first few compiles. The compile cache stays off, so every
+// compile does the full work.
+//
+// usage: node memory-stress.js name.js name.wasm name-sysroot.zip source.cpp [count]
+
+'use strict';
+
+const fs = require('fs');
+const path = require('path');
+
+const [jsFile, wasmFile, sysrootFile, sourceFile, countArg] = process.argv.slice(2);
+if (!sourceFile) {
+    console.error('usage: node memory-stress.js name.js name.wasm name-sysroot.zip source.cpp [count]');
+    process.exit(1);
+}
+const count = countArg ? +countArg : 500;
+const warmup = 3;
+
+function fail(message) {
+    console.error('error: ' + message);
+    process.exit(1);
+}
+
+// Same layout as heapStats() in process-clang.js, plus the wasm memory's size
+function heapStats() {
+    let p = emModule._malloc(20);
+    emModule.ccall('get_heap_stats', null, ['number'], [p]);
+    let [heapSize, inUse, sysrootEntries, sysrootBytes, preambleBytes] = new Uint32Array(emModule.HEAPU8.buffer, p, 5);
+    emModule._free(p);
+    return { heapSize, inUse, sysrootEntries, sysrootBytes, preambleBytes, memory: emModule.HEAPU8.length };
+}
+
+let emModule = {
+    noInitialRun: true,
+    wasmBinary: fs.readFileSync(wasmFile),
+    print: text => console.log(text),
+    printErr: text => console.error(text),
+
+    postRun() {
+        let zip = fs.readFileSync(sysrootFile);
+        let data = emModule._malloc(zip.length);
+        emModule.HEAPU8.set(zip, data);
+        if (!emModule.ccall('mount_archive', 'number', ['string', 'number', 'number'], ['/usr/', data, zip.length]))
+            fail('unable to mount ' + sysrootFile);
+
+        let source = fs.readFileSync(sourceFile, 'utf8');
+        let baseline, stats;
+        for (let i = 0; i < count; ++i) {
+            let p = emModule.ccall('compile_buffer', 'number', ['string', 'string', 'number', 'number'],
+                [source, '', 0, 0]);
+            let ok = emModule.HEAPU32[p >> 2];
+            let diagnostics = emModule.UTF8ToString(emModule.HEAPU32[(p + 12) >> 2]);
+            emModule.ccall('free_compile_result', null, ['number'], [p]);
+            if (!ok || !i)
+                process.stderr.write(diagnostics);
+            if (!ok)
+                fail(path.basename(sourceFile) + ' failed to compile');
+            stats = heapStats();
+            if (i + 1 === Math.min(warmup, count))
+                baseline = stats;
+            if ((i + 1) % 50 === 0)
+                console.log((i + 1) + ' compiles: heap ' + stats.heapSize + ' bytes, in use ' + stats.inUse +
+                    ', wasm memory ' + stats.memory);
+        }
+        console.log('heap: ' + baseline.heapSize + ' bytes after ' + Math.min(warmup, count) + ' compiles, ' +
+            stats.heapSize + ' after ' + count);
+        console.log('kept between compiles: ' + stats.sysrootEntries + ' sysroot entries, ' + stats.sysrootBytes +
+            ' bytes cached, ' + stats.preambleBytes + ' bytes of preamble');
+        if (stats.heapSize > baseline.heapSize + baseline.heapSize / 20)
+            fail('heap grew from ' + baseline.heapSize + ' to ' + stats.heapSize + ' bytes');
+    },
+};
+
+require(path.resolve(jsFile))(emModule);
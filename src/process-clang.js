@@ -21,33 +21,10 @@
 'use strict';
 
 importScripts('process.js');
-importScripts('zip.js/zip.js');
-importScripts('zip.js/inflate.js');
-
-zip.useWebWorkers = false;
 
 let files = {};
 let nextFileId = 0;
 
-class ArrayBufferReader extends zip.Reader {
-    constructor(arrayBuffer) {
-        super();
-        this.arrayBuffer = arrayBuffer;
-        this.size = 0;
-    }
-
-    init(callback) {
-        this.size = this.arrayBuffer.byteLength;
-        callback();
-    }
-
-    readUint8Array(index, length, callback) {
-        // zip.js assumes the Uint8Array points to the beginning of
-        // its ArrayBuffer, so we have to copy.
-        callback(new Uint8Array(this.arrayBuffer.slice(index, index + length)));
-    }
-}
-
 async function fetchFile(url) {
     if (url in files)
         return files[url];
@@ -60,118 +37,197 @@ async function fetchFile(url) {
     return files[url];
 }
 
-async function unzipFile(file) {
-    if (file.basePath)
-        return file.basePath;
-    emModule.print('unzip...');
-    let basePath = 'fetched_' + nextFileId++ + '/';
-    emModule.FS.mkdir(basePath.slice(0, -1));
-
-    await new Promise((resolve, reject) => {
-        zip.createReader(
-            new ArrayBufferReader(file.content),
-            reader => {
-                reader.getEntries(entries => {
-                    for (let entry of entries) {
-                        if (entry.directory) {
-                            let path = basePath + entry.filename;
-                            emModule.FS.mkdir(path.slice(0, -1));
-                        } else {
-                            entry.getData({
-                                init(callback) {
-                                    callback();
-                                },
-                                writeUint8Array(array, callback) {
-                                    let path = basePath + entry.filename;
-                                    emModule.FS.writeFile(path, array, { encoding: 'binary' });
-                                    callback();
-                                },
-                                getData() { },
-                            }, () => { });
-                        }
-                    }
-                    resolve();
-                })
-            }, e => {
-                if (e instanceof Error)
-                    reject(e);
-                else
-                    reject(new Error(e));
-            });
-    });
+// Hands a zip to clang's archive file system, which inflates each file on
+// first use. The wasm heap takes over the content; only the mount point is
+// kept.
+function mountArchive(file, mountPoint) {
+    if (file.mountPoint)
+        return file.mountPoint;
+    let size = file.content.byteLength;
+    let data = emModule._malloc(size);
+    emModule.HEAPU8.set(new Uint8Array(file.content), data);
+    if (!emModule.ccall('mount_archive', 'number', ['string', 'number', 'number'], [mountPoint, data, size]))
+        throw new Error('Unable to mount ' + file.url);
+    file.content = null;
+    file.mountPoint = mountPoint;
+    return mountPoint;
+}
 
-    emModule.print('unzip finished');
-    file.basePath = basePath;
-    return basePath;
-} // unzipFile
+// Compiled objects persist across page loads in IndexedDB
+const compileCacheDir = '/compile-cache';
 
-commands.loadBinaryen = function () {
-    importScripts('binaryen.js');
-    postMessage({ function: 'workerBinaryenLoaded' });
+function syncCompileCache(populate) {
+    return new Promise(resolve => {
+        emModule.FS.syncfs(populate, e => {
+            if (e && console.log)
+                console.log('compile cache:', e);
+            resolve();
+        });
+    });
 }
 
-commands.compile = async function ({ code, link, optimize }) {
+emModule.postRun = async function () {
     try {
-        let systemIncludes = '';
-        let re = /^\s*\/\/\s*cib\s*:\s*(\{.*$)/gm;
-        let searchResult;
-        while (searchResult = re.exec(code)) {
-            try {
-                let json = JSON.parse(searchResult[1]);
-                if (json.fetch && json.unzip_compiler && json.system_includes) {
-                    let file = await fetchFile(json.fetch + '');
-                    let basePath = await unzipFile(file);
-                    for (let a of json.system_includes)
-                        systemIncludes += ':' + basePath + a;
-                }
-            } catch (e) {
-                console.log(e);
-                emModule.printErr(e.toString());
-                postMessage({ function: 'workerCompileDone', result: 0 });
-                return;
-            }
+        // Replaces --preload-file; the sysroot mounts at LIB_PREFIX. A
+        // snapshot (see snapshot.js) already has it.
+        if (!emModule.snapshot || !emModule.snapshot.mounted.includes('/usr/')) {
+            await setStatusAsync('init', 'Loading ' + emModule.moduleName + '-sysroot.zip');
+            mountArchive(await fetchFile(emModule.moduleName + '-sysroot.zip'), '/usr/');
         }
+    } catch (e) {
+        if (console.log)
+            console.log(e);
+        await setStatusAsync('error', 'Error loading sysroot');
+        terminate();
+        return;
+    }
+    emModule.callMain();
+    try {
+        emModule.FS.mkdir(compileCacheDir);
+        emModule.FS.mount(emModule.FS.filesystems.IDBFS, {}, compileCacheDir);
+        await syncCompileCache(true);
+        emModule.ccall('set_compile_cache', null, ['string'], [compileCacheDir]);
+    } catch (e) {
+        if (console.log)
+            console.log('compile cache disabled:', e);
+    }
+    sendMessage({ function: 'workerReady' });
+};
 
-        emModule.FS.writeFile('source', code);
-        if (link || optimize)
-            emModule.print('Compile...');
-        let ok = emModule.ccall(
-            'compile', 'number', ['string', 'string', 'string'], ['source', 'result.wasm', systemIncludes]);
+// Reads and frees a CompileResult: ok, size, data, diagnostics, trace.
+// Returns { result, diagnostics, trace }; result is null on error, trace is
+// null unless it was asked for.
+function readCompileResult(p, printDiagnostics) {
+    let [ok, size, data, diagnostics, trace] = new Uint32Array(emModule.HEAPU8.buffer, p, 5);
+    let result = ok ? emModule.HEAPU8.slice(data, data + size) : null;
+    diagnostics = emModule.UTF8ToString(diagnostics);
+    if (printDiagnostics)
+        for (let line of diagnostics.split('\n'))
+            if (line)
+                emModule.printErr(line);
+    trace = trace ? emModule.UTF8ToString(trace) : null;
+    emModule.ccall('free_compile_result', null, ['number'], [p]);
+    return { result, diagnostics, trace };
+}
+
+// clang's get_heap_stats(): heapSize is what malloc has taken from the wasm
+// heap, which never shrinks; the rest is what stays cached between compiles
+function heapStats() {
+    let p = emModule._malloc(20);
+    emModule.ccall('get_heap_stats', null, ['number'], [p]);
+    let [heapSize, inUse, sysrootEntries, sysrootBytes, preambleBytes] = new Uint32Array(emModule.HEAPU8.buffer, p, 5);
+    emModule._free(p);
+    return { heapSize, inUse, sysrootEntries, sysrootBytes, preambleBytes };
+}
 
-        if (ok && link) {
-            emModule.print('Link...');
-            ok = emModule.ccall(
-                'link_wasm', 'number', ['string', 'string', 'number'], ['result.wasm', 'result.wasm', 16 * 1024]);
+commands.heapStats = function () {
+    postMessage({ function: 'workerHeapStats', stats: heapStats() });
+};
+
+// Returns the object, or the linked contract if link is set, without going
+// through the file system. null on error. trace: also return a Chrome trace
+// (chrome://tracing) of where the compile spent its time. lto: optimize the
+// contract together with rtl-eos when linking. cancelled: polled by clang
+// while it runs (see compile_cancelled()); a cancelled compile returns null
+// and doesn't print its diagnostics.
+function compileBuffer(code, systemIncludes, { link, optimize, optimizeLevel, shrink, printDiagnostics = true, trace = false, lto = false, cancelled = null }) {
+    let p;
+    emModule.compileCancelled = cancelled;
+    try {
+        if (link)
+            p = emModule.ccall(
+                'compile_link_buffer', 'number', ['string', 'string', 'number', 'number', 'number', 'number', 'number', 'number'],
+                [code, systemIncludes, optimize ? 1 : 0, 16 * 1024, optimizeLevel, optimizeLevel ? shrink : 0, trace ? 1 : 0,
+                    lto ? 1 : 0]);
+        else
+            p = emModule.ccall(
+                'compile_buffer', 'number', ['string', 'string', 'number', 'number'],
+                [code, systemIncludes, optimize ? 1 : 0, trace ? 1 : 0]);
+    } finally {
+        emModule.compileCancelled = null;
+    }
+    return readCompileResult(p, printDiagnostics && !(cancelled && cancelled()));
+}
+
+// Fetches and mounts the header zips named by // cib: {...} comments. Returns
+// their include directories as a ':'-separated list.
+async function getSystemIncludes(code) {
+    let systemIncludes = '';
+    let re = /^\s*\/\/\s*cib\s*:\s*(\{.*$)/gm;
+    let searchResult;
+    while (searchResult = re.exec(code)) {
+        let json = JSON.parse(searchResult[1]);
+        if (json.fetch && json.unzip_compiler && json.system_includes) {
+            let file = await fetchFile(json.fetch + '');
+            let basePath = mountArchive(file, '/fetched_' + nextFileId++ + '/');
+            for (let a of json.system_includes)
+                systemIncludes += ':' + basePath + a;
         }
+    }
+    return systemIncludes;
+}
 
-        let result = null;
-        if (ok)
-            result = emModule.FS.readFile('result.wasm');
-
-        if (optimize && ok) {
-            emModule.print('wasm size: ' + result.length);
-            emModule.print('Optimize...');
-            try {
-                let bytes = Binaryen._malloc(result.length);
-                if (!bytes)
-                    throw new Error('Binaryen: out of memory');
-                Binaryen.writeArrayToMemory(result, bytes);
-                let m = Binaryen._BinaryenModuleRead(bytes, result.length);
-                Binaryen._free(bytes);
-
-                Binaryen._BinaryenModuleOptimize(m);
-
-                let size = Binaryen._BinaryenModuleWrite2(m);
-                let pos = Binaryen._BinaryenModuleWrite2GetBuffer();
-                result = new Uint8Array(Binaryen.HEAP8.slice(pos, pos + size));
-                Binaryen._BinaryenModuleDispose(m);
-            } catch (e) {
-                emModule.print(e.toString());
-                result = null;
-            }
+// Bumped by each compile request; a tiered compile drops its optimized tier
+// when a newer request is waiting
+let compileGeneration = 0;
+
+// optimize: true or 0-4. shrink: 0-2; 1 matches -Os. Only applies when linking.
+// tiered: first send an unoptimized build (tier: 'fast'), then an optimized
+// one (tier: 'optimized'). id is passed back so the page can drop stale
+// results. trace: attach a Chrome trace of the (final tier's) compile as
+// trace. lto: link-time optimization with rtl-eos; only the final tier uses
+// it. cancelFlags: an Int32Array on a SharedArrayBuffer holding the id of the
+// compile the page still wants. Once it changes, this compile stops at its
+// next check and posts nothing; one still queued here doesn't start.
+commands.compile = async function ({ id, code, link, optimize, shrink = 1, tiered = false, trace = false, lto = false, cancelFlags = null }) {
+    let generation = ++compileGeneration;
+    let cancelled = cancelFlags ? () => Atomics.load(cancelFlags, 0) !== id : null;
+    try {
+        let systemIncludes;
+        try {
+            systemIncludes = await getSystemIncludes(code);
+        } catch (e) {
+            console.log(e);
+            emModule.printErr(e.toString());
+            postMessage({ function: 'workerCompileDone', id, result: 0 });
+            return;
         }
+        if (cancelled && cancelled())
+            return;
+
+        let optimizeLevel = optimize === true ? 2 : (optimize || 0);
+        let printDiagnostics = true;
+        if (tiered) {
+            emModule.print('Compile (unoptimized)...');
+            let { result } = compileBuffer(code, systemIncludes, { link, optimize: false, optimizeLevel: 0, cancelled });
+            if (cancelled && cancelled())
+                return;
+            postMessage({ function: 'workerCompileDone', id, result, tier: 'fast' });
+            if (!result)
+                return;
 
-        postMessage({ function: 'workerCompileDone', result });
+            // Let a newer request in before starting the slow tier
+            await new Promise(resolve => setTimeout(resolve, 0));
+            if (generation !== compileGeneration || (cancelled && cancelled()))
+                return;
+            emModule.print('Optimizing in background...');
+            printDiagnostics = false;
+        } else if (link) {
+            emModule.print(optimizeLevel ? 'Compile, link and optimize...' : 'Compile and link...');
+        } else if (optimize) {
+            emModule.print('Compile...');
+        }
+
+        let { result, trace: traceJson } = compileBuffer(
+            code, systemIncludes, { link, optimize: true, optimizeLevel, shrink, printDiagnostics, trace, lto, cancelled });
+
+        await syncCompileCache(false);
+
+        if ((tiered && generation !== compileGeneration) || (cancelled && cancelled()))
+            return;
+        postMessage({
+            function: 'workerCompileDone', id, result, tier: tiered ? 'optimized' : undefined, trace: traceJson,
+        });
     } catch (e) {
         console.log(e);
         setStatus('error', 'Fatal error');
@@ -179,3 +235,18 @@ commands.compile = async function ({ code, link, optimize }) {
         emModule.printErr(e.toString());
     }
 };
+
+// Diagnostics without code generation, for marking up the editor. Posts
+// workerSyntaxDone with id and diagnostics: [{ severity, file, line, column,
+// message }].
+commands.checkSyntax = async function ({ id, code }) {
+    let diagnostics = [];
+    try {
+        let systemIncludes = await getSystemIncludes(code);
+        let p = emModule.ccall('check_syntax', 'number', ['string', 'string'], [code, systemIncludes]);
+        diagnostics = JSON.parse(readCompileResult(p, false).diagnostics);
+    } catch (e) {
+        console.log(e);
+    }
+    postMessage({ function: 'workerSyntaxDone', id, diagnostics });
+};
@@ -43,8 +43,13 @@ emModule.instantiateWasmAsync = async function (imports, successCallback) {
             __indirect_function_table: imports.env.table,
             __linear_memory: imports.env.memory,
             __stack_pointer: 0, // dummy value, not used
+            __cib_clock: () => performance.now(),
         };
         this.wasmInstance = await WebAssembly.instantiate(this.wasmModule, { env });
+        // cib-link's dynCall_* thunks; emscripten's dynCall() looks here
+        for (let name in this.wasmInstance.exports)
+            if (name.startsWith('dynCall_') && !this[name])
+                this[name] = this.wasmInstance.exports[name];
         this.instanciating = false;
         await setStatusAsync('init', 'Initializing');
         successCallback(this.wasmInstance);
@@ -56,6 +61,69 @@ emModule.instantiateWasmAsync = async function (imports, successCallback) {
     }
 };
 
+// Instrumented rtl (cib-link --instrument) keeps a table of per-function
+// call counts and times; the index space starts after the imports. A user
+// module loaded next to it is instrumented too (see instrumentBodies()); its
+// entries follow the same layout in a block malloced from the rtl. Each
+// part of the profile is { entries, count, functionNames,
+// numFunctionImports }.
+function getProfile(exports, memory) {
+    if (!exports.__cib_profile)
+        return null;
+    let table = exports.__cib_profile();
+    let [count, flags] = new Uint32Array(memory.buffer, table, 2);
+    return { table, count, timed: !!(flags & PROFILE_FLAG_TIME) };
+}
+
+// The user module's entries. Each run reuses the block, growing it when a
+// module has more functions, instead of leaking one per run.
+let userProfile = { entries: 0, size: 0 };
+
+function getUserProfileEntries(exports, size) {
+    if (size > userProfile.size) {
+        if (userProfile.entries)
+            exports.free(userProfile.entries);
+        userProfile.entries = exports.malloc(size);
+        userProfile.size = size;
+    }
+    return userProfile.entries;
+}
+
+function resetProfile(exports, memory, parts) {
+    let profile = getProfile(exports, memory);
+    if (!profile)
+        return;
+    new Uint8Array(memory.buffer, profile.table + 8, PROFILE_HEADER_SIZE - 8).fill(0);
+    for (let { entries, count } of parts)
+        new Uint8Array(memory.buffer, entries, count * PROFILE_ENTRY_SIZE).fill(0);
+}
+
+function printProfile(exports, memory, parts) {
+    let profile = getProfile(exports, memory);
+    if (!profile)
+        return;
+    let entries = [];
+    for (let { entries: base, count, functionNames, numFunctionImports } of parts) {
+        for (let i = 0; i < count; ++i) {
+            let entry = base + i * PROFILE_ENTRY_SIZE;
+            let [self, total] = new Float64Array(memory.buffer, entry, 2);
+            let calls = new Uint32Array(memory.buffer, entry + 16, 1)[0];
+            let name = functionNames[numFunctionImports + i] || ('#' + (numFunctionImports + i));
+            if (calls && name !== '__cib_profile')
+                entries.push({ self, total, calls, name });
+        }
+    }
+    if (profile.timed)
+        entries.sort((a, b) => b.self - a.self);
+    else
+        entries.sort((a, b) => b.calls - a.calls);
+    let pad = (s, n) => (' '.repeat(n) + s).slice(-n);
+    emModule.print('\nFlat profile:');
+    emModule.print(pad('self ms', 12) + pad('total ms', 12) + pad('calls', 10) + '  name');
+    for (let { self, total, calls, name } of entries)
+        emModule.print(pad(self.toFixed(3), 12) + pad(total.toFixed(3), 12) + pad(calls, 10) + '  ' + name);
+}
+
 if (!inWorker) {
     emModule.postRun = function () {
         emModule.callMain();
@@ -68,9 +136,11 @@ commands.start = async function ({ moduleName, wasmBinary }) {
         if (inWorker)
             importScripts(moduleName + '.js');
         let binary = new Uint8Array(wasmBinary);
-        let { standardSections, relocs, linking } = getSegments(binary);
+        let { standardSections, relocs, linking, names } = getSegments(binary);
         let { dataSize, initFunctions } = getLinkingInfo(binary, linking)
         let { globalImports, numFunctionImports, spGlobalIndex } = fixSPImport(binary, standardSections);
+        emModule.functionNames = getFunctionNames(binary, names);
+        emModule.numFunctionImports = numFunctionImports;
         let types = getTypes(binary, standardSections);
         let functions = getFunctions(binary, standardSections, types);
         let globals = getGlobals(binary, standardSections);
@@ -111,7 +181,7 @@ commands.run = async function ({ wasmBinary }) {
         let rtlExports = emModule.wasmInstance.exports;
         let memory = emModule.wasmMemory;
         let table = emModule.wasmTable;
-        let { standardSections, relocs, linking } = getSegments(binary);
+        let { standardSections, relocs, linking, names } = getSegments(binary);
         let { dataSize, initFunctions } = getLinkingInfo(binary, linking)
         let memoryBase = rtlExports.malloc(dataSize);
         let tableBase = table.length;
@@ -125,10 +195,46 @@ commands.run = async function ({ wasmBinary }) {
         let bodies = getCode(binary, standardSections);
         let { dataSegments } = getData(binary, standardSections);
         generateNewBodies(binary, types, functions, bodies, spGlobalIndex);
+
+        // Profile user code into the same report as the rtl. Timing reads
+        // __cib_clock through a new last function import, which moves every
+        // defined function up by one.
+        let profile = getProfile(rtlExports, memory);
+        let profileParts = [];
+        let numImportedFunctions = numFunctionImports;
+        let importSection;
+        if (profile) {
+            let functionNames = getFunctionNames(binary, names);
+            for (let name in exports)
+                if (exports[name].kind === EXTERNAL_FUNCTION && !functionNames[exports[name].index])
+                    functionNames[exports[name].index] = name;
+            profileParts.push({
+                entries: profile.table + PROFILE_HEADER_SIZE, count: profile.count,
+                functionNames: emModule.functionNames, numFunctionImports: emModule.numFunctionImports,
+            });
+            let entries = getUserProfileEntries(rtlExports, functions.length * PROFILE_ENTRY_SIZE);
+            profileParts.push({ entries, count: functions.length, functionNames, numFunctionImports });
+            instrumentBodies(types, functions, bodies, profile.table, entries, profile.timed, numFunctionImports);
+            if (profile.timed) {
+                types.push({ argTypes: [], returnTypes: [TYPE_F64] });
+                importSection = generateImportWith(binary, standardSections[WASM_SEC_IMPORT], '__cib_clock', types.length - 1);
+                ++numImportedFunctions;
+                let shift = index => index >= numFunctionImports ? index + 1 : index;
+                for (let name in exports)
+                    if (exports[name].kind === EXTERNAL_FUNCTION)
+                        exports[name].index = shift(exports[name].index);
+                for (let elem of elems)
+                    elem.functions = elem.functions.map(shift);
+                for (let f of initFunctions)
+                    f.index = shift(f.index);
+            }
+        }
+
         let initName = '__cib_user_init';
-        generateInit(initName, types, numFunctionImports, functions, exports, bodies, initFunctions);
+        generateInit(initName, types, numImportedFunctions, functions, exports, bodies, initFunctions);
         let replacementSections = {
             [WASM_SEC_TYPE]: generateType(types),
+            [WASM_SEC_IMPORT]: importSection,
             [WASM_SEC_FUNCTION]: generateFunction(functions),
             [WASM_SEC_GLOBAL]: generateGlobal(globals),
             [WASM_SEC_EXPORT]: generateExport(exports),
@@ -146,6 +252,7 @@ commands.run = async function ({ wasmBinary }) {
             __linear_memory: memory,
             __indirect_function_table: table,
             __stack_pointer: 0, // dummy value, not used
+            __cib_clock: () => performance.now(),
 
             // __info_*: not used by runtime, but available to user code.
             __info_data_begin: () => memoryBase,
@@ -156,7 +263,9 @@ commands.run = async function ({ wasmBinary }) {
         let inst = await WebAssembly.instantiate(module, { env });
         wasmExports = inst.exports;
         inst.exports[initName]();
+        resetProfile(rtlExports, memory, profileParts);
         inst.exports.main();
+        printProfile(rtlExports, memory, profileParts);
     } catch (e) {
         if (console.log)
             console.log(e);
@@ -84,6 +84,12 @@ function checkCache(name, hash) {
     });
 } // checkCache
 
+// The only exports a snapshot may skip; see snapshot.js
+function isConstructor(name) {
+    return /^_*GLOBAL__(sub_)?I_/.test(name) || name === '___emscripten_environ_constructor' ||
+        name === 'globalCtors';
+}
+
 let emModule = {
     noInitialRun: true,
     instanciating: false,
@@ -151,7 +157,16 @@ let emModule = {
             this.wasmInstance = await WebAssembly.instantiate(this.wasmModule, imports);
             this.instanciating = false;
             await setStatusAsync('init', 'Initializing');
-            successCallback(this.wasmInstance);
+            if (this.snapshot) {
+                // Their work is already in memory
+                let exports = Object.assign({}, this.wasmInstance.exports);
+                for (let name of this.snapshot.constructors)
+                    if (isConstructor(name))
+                        exports[name] = () => { };
+                successCallback({ exports });
+            } else {
+                successCallback(this.wasmInstance);
+            }
         } catch (e) {
             if (console.log)
                 console.log(e.message);
@@ -160,6 +175,12 @@ let emModule = {
         }
     },
 
+    // The runtime reset sbrk's pointer before the snapshot's memory arrived
+    preRun() {
+        if (emModule.snapshot)
+            emModule.HEAP32[emModule.snapshot.dynamicTopPtr >> 2] = emModule.snapshot.dynamicTop;
+    },
+
     instantiateWasm(imports, successCallback) {
         this.wasmImports = imports;
         this.instantiateWasmAsync(imports, successCallback);
@@ -179,6 +200,12 @@ let commands = {
             emModule.moduleName = moduleName;
             emModule.wasmBinary = wasmBinary;
             await emModule.compileWasm();
+            // Built by snapshot.js: memory starts out initialized
+            let snapshot = WebAssembly.Module.customSections(emModule.wasmModule, 'cib-snapshot');
+            if (snapshot.length) {
+                emModule.snapshot = JSON.parse(new TextDecoder().decode(snapshot[0]));
+                emModule.TOTAL_MEMORY = emModule.snapshot.totalMemory;
+            }
             Module(emModule);
         } catch (e) {
             if (console.log)
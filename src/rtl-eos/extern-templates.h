@@ -0,0 +1,26 @@
+// Standard-library templates which rtl-eos instantiates once (templates/).
+// clang-eos enters this header right after a file which defines one of the
+// include guards it tests (see ExternTemplatesPlugin in clang.cpp).
+// Contracts then pull rtl-eos's copies from the archive instead of
+// generating their own. The header includes nothing itself, so a contract
+// which never includes <vector> declares nothing. Each section is declared
+// at most once; entering the header again as more guards get defined is
+// harmless. libc++ already does the same for basic_string<char>.
+//
+// An entry belongs here if build.py --template-stats-eos shows most of a
+// corpus of contracts (e.g. repos/eos/contracts) instantiating it, and it
+// compiles the same way in rtl-eos and in contracts. No corpus has been
+// measured yet, so there are none. Each entry is an extern template line in
+// the section for the headers it needs, plus its explicit instantiation in
+// a file of its own under templates/ (e.g. templates/vector-int.cpp). That
+// makes it its own archive member, so linkEos() only pulls in what a
+// contract uses.
+
+#if defined(_LIBCPP_VECTOR) && !defined(CIB_TEMPLATES_VECTOR)
+#define CIB_TEMPLATES_VECTOR
+#endif
+
+#if defined(_LIBCPP_VECTOR) && defined(_LIBCPP_STRING) &&                     \
+    !defined(CIB_TEMPLATES_VECTOR_STRING)
+#define CIB_TEMPLATES_VECTOR_STRING
+#endif
@@ -0,0 +1,24 @@
+// Standard-library templates which rtl instantiates once (templates/).
+// clang enters this header right after a file which defines one of the
+// include guards it tests (see ExternTemplatesPlugin in clang.cpp). User code
+// then links against rtl's copies instead of generating and then discarding
+// its own. The header includes nothing itself, so a compile which never
+// includes <vector> declares nothing. Each section is declared at most once;
+// entering the header again as more guards get defined is harmless. libc++
+// already does the same for basic_string<char> and the iostreams.
+//
+// An entry belongs here if build.py --template-stats shows most of a corpus
+// of user programs instantiating it, and it compiles the same way in rtl and
+// in user code. No corpus has been measured yet, so there are none. Each
+// entry is an extern template line in the section for the headers it needs,
+// plus its explicit instantiation in a file of its own under templates/
+// (e.g. templates/vector-int.cpp), which CMakeLists.txt picks up.
+
+#if defined(_LIBCPP_VECTOR) && !defined(CIB_TEMPLATES_VECTOR)
+#define CIB_TEMPLATES_VECTOR
+#endif
+
+#if defined(_LIBCPP_VECTOR) && defined(_LIBCPP_STRING) &&                     \
+    !defined(CIB_TEMPLATES_VECTOR_STRING)
+#define CIB_TEMPLATES_VECTOR_STRING
+#endif
@@ -0,0 +1,233 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Pre-initializes clang or clang-eos at build time, Wizer-style. Runs the
+// emscripten build under node until it's ready to compile: constructors, the
+// sysroot mounted from its zip, then prepare_snapshot(). It then writes a copy
+// of the wasm whose data segments hold the resulting linear memory. The
+// copy also gets a cib-snapshot custom section telling process.js which
+// constructors to skip, what to restore and what's already mounted. Wasm
+// globals need no saving: emscripten's are only the stack pointer and
+// temporaries, which are back at their initial values between calls. State
+// kept on the JS side of emscripten's library isn't captured.
+//
+// usage: node snapshot.js name.js name.wasm name-sysroot.zip output.wasm
+
+'use strict';
+
+const fs = require('fs');
+const path = require('path');
+
+const [jsFile, wasmFile, sysrootFile, outputFile] = process.argv.slice(2);
+if (!outputFile) {
+    console.error('usage: node snapshot.js name.js name.wasm name-sysroot.zip output.wasm');
+    process.exit(1);
+}
+
+// Runs of zeros at least this long split data segments; memory starts zeroed
+const minZeroRun = 64;
+
+const WASM_SEC_CUSTOM = 0;
+const WASM_SEC_DATA = 11;
+
+function readLeb(binary, pos) {
+    let result = 0, shift = 0, byte;
+    do {
+        byte = binary[pos.pos++];
+        result |= (byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return result >>> 0;
+}
+
+function pushLeb(out, value) {
+    do {
+        let byte = value & 0x7f;
+        value >>>= 7;
+        out.push(value ? byte | 0x80 : byte);
+    } while (value);
+}
+
+function pushBytes(out, bytes) {
+    for (let b of bytes)
+        out.push(b);
+}
+
+function section(id, payload) {
+    let out = [id];
+    pushLeb(out, payload.length);
+    return [Buffer.from(out), payload];
+}
+
+// One active segment per run of non-zero memory
+function dataSection(memory, end) {
+    let payload = [];
+    let segments = [];
+    let pos = 0;
+    while (pos < end) {
+        while (pos < end && !memory[pos])
+            ++pos;
+        if (pos === end)
+            break;
+        let begin = pos, zeros = 0;
+        while (pos < end && zeros < minZeroRun)
+            zeros = memory[pos++] ? 0 : zeros + 1;
+        segments.push([begin, pos - zeros]);
+    }
+    pushLeb(payload, segments.length);
+    let chunks = [];
+    for (let [begin, segEnd] of segments) {
+        let header = [0, 0x41]; // memory 0, i32.const
+        let offset = begin;
+        // i32.const takes a signed LEB
+        do {
+            let byte = offset & 0x7f;
+            offset >>>= 7;
+            let done = !offset && !(byte & 0x40);
+            header.push(done ? byte : byte | 0x80);
+            if (done)
+                break;
+        } while (true);
+        header.push(0x0b); // end
+        pushLeb(header, segEnd - begin);
+        chunks.push(Buffer.from(header), Buffer.from(memory.buffer, memory.byteOffset + begin, segEnd - begin));
+    }
+    return section(WASM_SEC_DATA, Buffer.concat([Buffer.from(payload), ...chunks]));
+}
+
+function customSection(name, content) {
+    let header = [];
+    pushLeb(header, Buffer.byteLength(name));
+    return section(WASM_SEC_CUSTOM, Buffer.concat([Buffer.from(header), Buffer.from(name), content]));
+}
+
+// Copies binary, replacing its data section and adding the cib-snapshot
+// section
+function rewrite(binary, memory, end, info) {
+    let parts = [binary.slice(0, 8)];
+    let pos = { pos: 8 };
+    let haveData = false;
+    while (pos.pos < binary.length) {
+        let begin = pos.pos;
+        let id = binary[pos.pos++];
+        let size = readLeb(binary, pos);
+        let payload = pos.pos;
+        pos.pos += size;
+        if (id === WASM_SEC_DATA) {
+            parts.push(...dataSection(memory, end));
+            haveData = true;
+        } else if (id === WASM_SEC_CUSTOM) {
+            let namePos = { pos: payload };
+            let nameSize = readLeb(binary, namePos);
+            if (binary.toString('utf8', namePos.pos, namePos.pos + nameSize) !== 'cib-snapshot')
+                parts.push(binary.slice(begin, pos.pos));
+        } else {
+            parts.push(binary.slice(begin, pos.pos));
+        }
+    }
+    if (!haveData)
+        throw new Error('no data section');
+    parts.push(...customSection('cib-snapshot', Buffer.from(JSON.stringify(info))));
+    return Buffer.concat(parts);
+}
+
+let wasmBinary = fs.readFileSync(wasmFile);
+let imports = null;
+let runtimeReady = false;
+let constructors = [];
+let others = [];
+
+// The exports emscripten's runtime calls to initialize: C++ static
+// constructors, environ's setup and the wasm backend's globalCtors. Their
+// work ends up in memory, so process.js can skip them. Keep in sync with
+// isConstructor() there.
+function isConstructor(name) {
+    return /^_*GLOBAL__(sub_)?I_/.test(name) || name === '___emscripten_environ_constructor' ||
+        name === 'globalCtors';
+}
+
+let emModule = {
+    noInitialRun: true,
+    wasmBinary,
+    print: text => console.log(text),
+    printErr: text => console.error(text),
+
+    // Records which exports run before the runtime is initialized. Anything
+    // besides a constructor might have left state outside memory, or be
+    // needed again, so the snapshot fails instead of skipping it.
+    instantiateWasm(info, successCallback) {
+        imports = info;
+        WebAssembly.instantiate(wasmBinary, info).then(({ instance }) => {
+            let exports = {};
+            for (let name in instance.exports) {
+                let value = instance.exports[name];
+                if (typeof value === 'function')
+                    exports[name] = (...args) => {
+                        if (!runtimeReady) {
+                            let list = isConstructor(name) ? constructors : others;
+                            if (!list.includes(name))
+                                list.push(name);
+                        }
+                        return value(...args);
+                    };
+                else
+                    exports[name] = value;
+            }
+            successCallback({ exports });
+        }, e => {
+            console.error(e);
+            process.exit(1);
+        });
+        return {};
+    },
+
+    onRuntimeInitialized() {
+        runtimeReady = true;
+    },
+
+    postRun() {
+        if (others.length)
+            throw new Error('called before initialization, but not constructors: ' + others.join(', '));
+        let zip = fs.readFileSync(sysrootFile);
+        let data = emModule._malloc(zip.length);
+        emModule.HEAPU8.set(zip, data);
+        if (!emModule.ccall('mount_archive', 'number', ['string', 'number', 'number'], ['/usr/', data, zip.length]))
+            throw new Error('Unable to mount ' + sysrootFile);
+        emModule.ccall('prepare_snapshot', null, [], []);
+
+        let memory = emModule.HEAPU8;
+        let dynamicTopPtr = imports.env.DYNAMICTOP_PTR;
+        if (typeof dynamicTopPtr !== 'number')
+            throw new Error('DYNAMICTOP_PTR import not found');
+        let dynamicTop = emModule.HEAP32[dynamicTopPtr >> 2];
+        let output = rewrite(wasmBinary, memory, dynamicTop, {
+            totalMemory: memory.length,
+            dynamicTopPtr,
+            dynamicTop,
+            constructors,
+            mounted: ['/usr/'],
+        });
+        fs.writeFileSync(outputFile, output);
+        console.log(path.basename(outputFile) + ': ' + dynamicTop + ' bytes of heap, ' + constructors.length +
+            ' constructors skipped, ' + output.length + ' bytes');
+    },
+};
+
+require(path.resolve(jsFile))(emModule);
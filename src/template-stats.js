@@ -0,0 +1,85 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Tallies the template instantiations in clang's --time-trace output, to pick
+// what src/rtl/extern-templates.h and src/rtl-eos/extern-templates.h should
+// list. Run it over the traces of a corpus compiled with
+// --time-trace-granularity 0, or the short instantiations are missing.
+// Members are counted under their class template specialization. Prints
+// each specialization with the number of traces which instantiated it and
+// the total time spent, the most widespread first.
+//
+// usage: node template-stats.js trace.json... [--top n]
+
+'use strict';
+
+const fs = require('fs');
+
+let files = process.argv.slice(2);
+let top = 40;
+let topIndex = files.indexOf('--top');
+if (topIndex >= 0) {
+    top = +files[topIndex + 1];
+    files.splice(topIndex, 2);
+}
+if (!files.length) {
+    console.error('usage: node template-stats.js trace.json... [--top n]');
+    process.exit(1);
+}
+
+// std::vector<int>::push_back<int> -> std::vector<int>: the name up to the
+// last top-level :: which follows a template argument list
+function specialization(name) {
+    let depth = 0, end = name.length;
+    for (let i = 0; i < name.length; ++i) {
+        if (name[i] === '<')
+            ++depth;
+        else if (name[i] === '>')
+            --depth;
+        else if (!depth && name.startsWith('::', i) && name[i - 1] === '>')
+            end = i;
+    }
+    return name.slice(0, end);
+}
+
+let stats = new Map();
+for (let file of files) {
+    let seen = new Set();
+    for (let event of JSON.parse(fs.readFileSync(file, 'utf8')).traceEvents) {
+        if (event.cat !== 'instantiate')
+            continue;
+        let name = specialization(event.name);
+        let entry = stats.get(name);
+        if (!entry)
+            stats.set(name, entry = { name, traces: 0, us: 0 });
+        if (!seen.has(name)) {
+            seen.add(name);
+            ++entry.traces;
+        }
+        entry.us += event.dur;
+    }
+}
+
+// Nested instantiations are counted in their parents' time too
+let sorted = [...stats.values()].sort((a, b) => b.traces - a.traces || b.us - a.us);
+console.log(files.length + ' traces');
+console.log('traces    ms  specialization');
+for (let { name, traces, us } of sorted.slice(0, top))
+    console.log(String(traces).padStart(6) + (us / 1000).toFixed(1).padStart(6) + '  ' + name);
@@ -0,0 +1,30 @@
+// Checks where ExternTemplatesPlugin enters its header: once for each guard,
+// right after the header which defines it, and not at all before. It passes
+// if it compiles. build.py --test-extern-templates compiles it with the
+// native clang, with CIB_EXTERN_TEMPLATES pointing at extern-templates.h here.
+
+#include <cstdio>
+#ifdef CIB_TEST_ENTERED
+#error entered before <vector>
+#endif
+
+#include <vector>
+#if CIB_TEST_ENTERED != 1
+#error not entered once after <vector>
+#endif
+
+#include <cstdlib>
+#include <vector>
+#if CIB_TEST_ENTERED != 1
+#error entered again without a new guard
+#endif
+
+#include <string>
+#if CIB_TEST_ENTERED != 2
+#error not entered again after <string>
+#endif
+
+int main() {
+    std::vector<int> v{1, 2, 3};
+    printf("%zu\n", v.size());
+}
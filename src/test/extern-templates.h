@@ -0,0 +1,17 @@
+// Stands in for src/rtl/extern-templates.h when build.py
+// --test-extern-templates compiles extern-templates.cpp. It has no sections
+// of its own, so the test sees every time clang enters it.
+
+#ifndef CIB_TEST_ENTERED
+#define CIB_TEST_ENTERED 1
+#elif CIB_TEST_ENTERED == 1
+#undef CIB_TEST_ENTERED
+#define CIB_TEST_ENTERED 2
+#else
+#error extern-templates.h entered more than twice
+#endif
+
+// Fails if it's entered before <vector> has declared std::vector
+#ifdef _LIBCPP_VECTOR
+extern template class std::vector<int>;
+#endif
@@ -0,0 +1,581 @@
+// Copyright 2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+// Native checks of the linker in wasm-tools.cpp. Each one links small
+// objects built here, laid out the way clang lays them out, and looks at
+// what linkEos() left in Linked and in the modules. Run by build.py --test.
+
+#include "../wasm-tools.h"
+
+#include <algorithm>
+
+using namespace std;
+using namespace WasmTools;
+
+static int failures = 0;
+
+#define EXPECT(cond)                                                           \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            ++failures;                                                        \
+            printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #cond);          \
+        }                                                                      \
+    } while (0)
+
+// A function body. Indexes which the linker replaces get a 5-byte LEB and a
+// reloc, as clang emits them.
+struct Body {
+    vector<uint8_t> code{0}; // no locals
+    vector<Reloc> relocs{};
+
+    Body& op(uint8_t opcode) {
+        code.push_back(opcode);
+        return *this;
+    }
+
+    Body& indexed(uint8_t opcode, uint8_t type, uint32_t index) {
+        code.push_back(opcode);
+        relocs.push_back(Reloc{sec_code, type, uint32_t(code.size()), index});
+        push_leb5(code, index);
+        return *this;
+    }
+
+    Body& i32_const(uint32_t value) {
+        code.push_back(instr_i32_const);
+        push_leb5(code, value);
+        return *this;
+    }
+
+    Body& get_local(uint32_t index) {
+        code.push_back(instr_get_local);
+        push_leb5(code, index);
+        return *this;
+    }
+
+    Body& call(uint32_t function) {
+        return indexed(instr_call, reloc_function_index_leb, function);
+    }
+
+    Body& call_indirect(uint32_t type) {
+        indexed(instr_call_indirect, reloc_type_index_leb, type);
+        return op(0); // table
+    }
+
+    Body& get_global(uint32_t global) {
+        return indexed(instr_get_global, reloc_global_index_leb, global);
+    }
+
+    Body& set_global(uint32_t global) {
+        return indexed(instr_set_global, reloc_global_index_leb, global);
+    }
+
+    // get_global sp; i32.const frame; i32.sub; set_global sp
+    Body& prologue(uint32_t sp, uint32_t frame) {
+        get_global(sp).i32_const(frame).op(instr_i32_sub);
+        return set_global(sp);
+    }
+};
+
+// Builds a relocatable object. Imports come before definitions, as in the
+// index spaces they share. Every export is listed in the linking section,
+// and data symbols are exported globals holding the data's offset.
+struct Object {
+    string filename;
+    vector<FunctionType> types{};
+    vector<tuple<string, uint8_t, uint32_t>> imports{}; // type or mutability
+    uint32_t num_imported_functions{};
+    uint32_t num_imported_globals{};
+    vector<tuple<uint32_t, Body>> functions{};
+    vector<uint32_t> globals{};
+    vector<tuple<string, uint8_t, uint32_t>> exports{};
+    vector<tuple<string, uint32_t>> symbols{}; // name, flags
+    vector<uint32_t> elements{};
+    vector<DataSegment> segments{};
+    vector<vector<uint8_t>> segment_data{};
+    vector<string> segment_names{};
+    uint32_t data_size{};
+    vector<tuple<string, vector<uint32_t>, vector<uint32_t>>> comdats{};
+
+    explicit Object(string filename) : filename{move(filename)} {}
+
+    uint32_t type(vector<uint8_t> args, vector<uint8_t> results = {}) {
+        types.push_back(FunctionType{move(args), move(results)});
+        return types.size() - 1;
+    }
+
+    uint32_t import_function(const string& name, uint32_t type) {
+        imports.emplace_back(name, external_function, type);
+        symbols.emplace_back(name, 0);
+        return num_imported_functions++;
+    }
+
+    uint32_t import_global(const string& name) {
+        imports.emplace_back(name, external_global, 1);
+        symbols.emplace_back(name, 0);
+        return num_imported_globals++;
+    }
+
+    uint32_t function(uint32_t type, Body body, const string& name = "",
+                      uint32_t flags = 0) {
+        auto index = num_imported_functions + functions.size();
+        functions.emplace_back(type, move(body));
+        if (!name.empty()) {
+            exports.emplace_back(name, external_function, index);
+            symbols.emplace_back(name, flags);
+        }
+        return index;
+    }
+
+    // Returns the segment's index
+    uint32_t data(const string& segment, vector<uint8_t> content,
+                  const string& name, uint32_t flags = 0,
+                  uint32_t alignment = 0, uint32_t segment_flags = 0) {
+        auto offset = (data_size + (1u << alignment) - 1) & -(1u << alignment);
+        segments.push_back(DataSegment{offset, uint32_t(content.size()), 0});
+        segments.back().alignment = alignment;
+        segments.back().flags = segment_flags;
+        segment_data.push_back(move(content));
+        segment_names.push_back(segment);
+        data_size = offset + segments.back().size;
+        auto global = num_imported_globals + globals.size();
+        globals.push_back(offset);
+        exports.emplace_back(name, external_global, global);
+        symbols.emplace_back(name, flags);
+        return segments.size() - 1;
+    }
+
+    uint32_t element(uint32_t function) {
+        elements.push_back(function);
+        return elements.size() - 1;
+    }
+
+    void comdat(const string& name, vector<uint32_t> functions,
+                vector<uint32_t> segments = {}) {
+        comdats.emplace_back(name, move(functions), move(segments));
+    }
+
+    unique_ptr<Module> build() {
+        vector<uint8_t> b(8);
+        write_i32(b, 0, 0x6d736100);
+        write_i32(b, 4, 1);
+        auto section = [&](uint8_t id, auto f) {
+            b.push_back(id);
+            auto size_pos = b.size();
+            b.insert(b.end(), 5, 0);
+            auto begin = b.size();
+            f();
+            write_leb5(b, size_pos, b.size() - begin);
+        };
+        auto custom = [&](const char* name, auto f) {
+            section(sec_custom, [&] {
+                push_str(b, name);
+                f();
+            });
+        };
+        auto subsection = [&](uint8_t type, auto f) {
+            b.push_back(type);
+            auto size_pos = b.size();
+            b.insert(b.end(), 5, 0);
+            auto begin = b.size();
+            f();
+            write_leb5(b, size_pos, b.size() - begin);
+        };
+
+        section(sec_type, [&] {
+            push_leb5(b, types.size());
+            for (auto& type : types) {
+                b.push_back(type_func);
+                push_leb5(b, type.arg_types.size());
+                b.insert(b.end(), type.arg_types.begin(), type.arg_types.end());
+                push_leb5(b, type.return_types.size());
+                b.insert(b.end(), type.return_types.begin(),
+                         type.return_types.end());
+            }
+        });
+        section(sec_import, [&] {
+            push_leb5(b, imports.size());
+            for (auto& [name, kind, value] : imports) {
+                push_str(b, "env");
+                push_str(b, name);
+                b.push_back(kind);
+                if (kind == external_function) {
+                    push_leb5(b, value);
+                } else {
+                    b.push_back(type_i32);
+                    b.push_back(value);
+                }
+            }
+        });
+        section(sec_function, [&] {
+            push_leb5(b, functions.size());
+            for (auto& [type, body] : functions)
+                push_leb5(b, type);
+        });
+        section(sec_global, [&] {
+            push_leb5(b, globals.size());
+            for (auto offset : globals) {
+                b.push_back(type_i32);
+                b.push_back(0);
+                push_init_expr32(b, offset);
+            }
+        });
+        section(sec_export, [&] {
+            push_leb5(b, exports.size());
+            for (auto& [name, kind, index] : exports) {
+                push_str(b, name);
+                b.push_back(kind);
+                push_leb5(b, index);
+            }
+        });
+        if (!elements.empty()) {
+            section(sec_elem, [&] {
+                push_leb5(b, 1);
+                push_leb5(b, 0);
+                push_init_expr32(b, 0);
+                push_leb5(b, elements.size());
+                for (auto function : elements)
+                    push_leb5(b, function);
+            });
+        }
+        vector<Reloc> relocs;
+        section(sec_code, [&] {
+            auto begin = b.size();
+            push_leb5(b, functions.size());
+            for (auto& [type, body] : functions) {
+                push_leb5(b, body.code.size());
+                for (auto reloc : body.relocs) {
+                    reloc.offset += b.size() - begin;
+                    relocs.push_back(reloc);
+                }
+                b.insert(b.end(), body.code.begin(), body.code.end());
+            }
+        });
+        section(sec_data, [&] {
+            push_leb5(b, segments.size());
+            for (size_t i = 0; i < segments.size(); ++i) {
+                push_leb5(b, 0);
+                push_init_expr32(b, segments[i].offset);
+                push_leb5(b, segments[i].size);
+                b.insert(b.end(), segment_data[i].begin(),
+                         segment_data[i].end());
+            }
+        });
+        custom("linking", [&] {
+            subsection(link_symbol_info, [&] {
+                push_leb5(b, symbols.size());
+                for (auto& [name, flags] : symbols) {
+                    push_str(b, name);
+                    push_leb5(b, flags);
+                }
+            });
+            subsection(link_data_size, [&] { push_leb5(b, data_size); });
+            subsection(link_segment_info, [&] {
+                push_leb5(b, segments.size());
+                for (size_t i = 0; i < segments.size(); ++i) {
+                    push_str(b, segment_names[i]);
+                    push_leb5(b, segments[i].alignment);
+                    push_leb5(b, segments[i].flags);
+                }
+            });
+            subsection(link_comdat_info, [&] {
+                push_leb5(b, comdats.size());
+                for (auto& [name, functions, segments] : comdats) {
+                    push_str(b, name);
+                    push_leb5(b, 0);
+                    push_leb5(b, functions.size() + segments.size());
+                    for (auto index : functions) {
+                        push_leb5(b, comdat_function);
+                        push_leb5(b, index);
+                    }
+                    for (auto index : segments) {
+                        push_leb5(b, comdat_data);
+                        push_leb5(b, index);
+                    }
+                }
+            });
+        });
+        custom("reloc.CODE", [&] {
+            push_leb5(b, sec_code);
+            push_leb5(b, relocs.size());
+            for (auto& reloc : relocs) {
+                push_leb5(b, reloc.type);
+                push_leb5(b, reloc.offset);
+                push_leb5(b, reloc.index);
+            }
+        });
+
+        auto module = make_unique<Module>();
+        module->filename = filename;
+        module->binary = move(b);
+        read_module(*module);
+        return module;
+    }
+};
+
+static Module& add(Linked& linked, unique_ptr<Module> module) {
+    linked.modules.push_back(move(module));
+    return *linked.modules.back();
+}
+
+static void link(Linked& linked, vector<Module*> main_modules,
+                 uint32_t stack_size = 1024) {
+    linkEos(linked, main_modules, stack_size);
+}
+
+// Where the data symbol name ended up in linear memory
+static uint32_t address(const Module& module, const string& name) {
+    auto& symbol = module.symbols.at(name);
+    return *module.replacement_addresses[*symbol.export_global_index];
+}
+
+static uint32_t final_function(const Module& module, uint32_t index) {
+    return module.replacement_functions[index];
+}
+
+static size_t occurrences(const vector<uint8_t>& binary, const string& s) {
+    size_t n = 0;
+    for (auto it = binary.begin();
+         (it = search(it, binary.end(), s.begin(), s.end())) != binary.end();
+         ++it)
+        ++n;
+    return n;
+}
+
+// user-026: identical constants share a copy; a string which ends another
+// shares its tail
+static void test_merge_data() {
+    Object a{"a.o"};
+    a.data(".rodata.str1.1", {'h', 'e', 'l', 'l', 'o', 0}, "a_str");
+    a.data(".rodata.cst4", {1, 2, 3, 4}, "a_cst", 0, 2);
+    Object b{"b.o"};
+    b.data(".rodata.str1.1", {'l', 'o', 0}, "b_str");
+    b.data(".rodata.cst4", {1, 2, 3, 4}, "b_cst", 0, 2);
+    b.data(".data.b_var", {9, 9, 9, 9}, "b_var", 0, 2);
+
+    Linked linked;
+    auto& ma = add(linked, a.build());
+    auto& mb = add(linked, b.build());
+    link(linked, {&ma, &mb});
+
+    EXPECT(linked.merged_data.size() == 2);
+    EXPECT(address(mb, "b_str") == address(ma, "a_str") + 3);
+    EXPECT(address(mb, "b_cst") == address(ma, "a_cst"));
+    EXPECT(address(ma, "a_cst") % 4 == 0);
+    EXPECT(address(mb, "b_var") + 4 <= address(ma, "a_str") ||
+           address(mb, "b_var") >= address(ma, "a_str") + 6);
+    EXPECT(occurrences(linked.binary, "hello") == 1);
+    EXPECT(occurrences(linked.binary, "\1\2\3\4") == 1);
+}
+
+// user-027: the first module to bring in a comdat keeps it; later copies
+// are dropped and their symbols resolve to the kept one, except data which
+// only a local symbol reaches
+static void test_claim_comdats() {
+    auto make = [](const string& filename, const string& user) {
+        Object o{filename};
+        auto v = o.type({});
+        auto f = o.function(v, Body{}.op(instr_end), "f", sym_binding_weak);
+        auto x = o.data(".data.x", {1, 0, 0, 0}, "x", sym_binding_weak, 2);
+        auto y = o.data(".data.y", {2, 0, 0, 0}, "y", sym_binding_local, 2);
+        o.comdat("f", {f}, {x, y});
+        o.function(v, Body{}.call(f).op(instr_end), user);
+        return o.build();
+    };
+
+    Linked linked;
+    auto& a = add(linked, make("a.o", "a_user"));
+    auto& b = add(linked, make("b.o", "b_user"));
+    link(linked, {&a, &b});
+    auto f = *a.symbols.at("f").export_function_index;
+
+    EXPECT(linked.comdat_owners.at("f") == &a);
+    EXPECT(!a.functions[f].is_discarded);
+    EXPECT(b.functions[f].is_discarded);
+    EXPECT(final_function(b, f) == final_function(a, f));
+    EXPECT(!a.data_segments[0].is_discarded);
+    EXPECT(b.data_segments[0].is_discarded);
+    EXPECT(address(b, "x") == address(a, "x"));
+    EXPECT(!b.data_segments[1].is_discarded);
+    EXPECT(address(b, "y") != address(a, "y"));
+}
+
+// user-029: a call_indirect whose type has a single table entry becomes
+// drop; call. With drop_unused_elements, entries no call_indirect can
+// reach leave the table.
+static void test_devirtualize() {
+    Object o{"a.o"};
+    auto ii = o.type({type_i32}, {type_i32});
+    auto iv = o.type({type_i32});
+    auto v = o.type({});
+    auto only = o.function(ii, Body{}.get_local(0).op(instr_end), "only");
+    auto cb1 = o.function(iv, Body{}.op(instr_end), "cb1");
+    auto cb2 = o.function(iv, Body{}.op(instr_end), "cb2");
+    o.element(only);
+    o.element(cb1);
+    o.element(cb2);
+    Body body;
+    body.i32_const(5).i32_const(0);
+    auto devirtualized = body.code.size();
+    body.call_indirect(ii).op(instr_drop);
+    body.i32_const(7).i32_const(1);
+    auto kept = body.code.size();
+    body.call_indirect(iv).op(instr_end);
+    auto caller = o.function(v, move(body), "apply");
+
+    Linked linked;
+    linked.devirtualize = true;
+    linked.drop_unused_elements = true;
+    auto& m = add(linked, o.build());
+    link(linked, {&m});
+    auto pos = m.functions[caller].body_begin;
+
+    EXPECT(m.binary[pos + devirtualized] == instr_drop);
+    EXPECT(m.binary[pos + devirtualized + 1] == instr_call);
+    size_t index_pos = pos + devirtualized + 2;
+    EXPECT(read_leb(m.binary, index_pos) == final_function(m, only));
+    EXPECT(m.binary[pos + kept] == instr_call_indirect);
+    EXPECT(linked.indirect_call_counts.size() == 1);
+    EXPECT(linked.indirect_call_counts.begin()->second == 1);
+    EXPECT(linked.elements.size() == 2);
+    EXPECT(std::count(linked.elements.begin(), linked.elements.end(),
+                      final_function(m, only)) == 0);
+    EXPECT(std::count(linked.elements.begin(), linked.elements.end(),
+                      final_function(m, cb1)) == 1);
+    EXPECT(std::count(linked.elements.begin(), linked.elements.end(),
+                      final_function(m, cb2)) == 1);
+    EXPECT(linked.function_element_map.at(final_function(m, only)) >=
+           linked.element_offset + linked.elements.size());
+}
+
+// user-032: the stack bound is the deepest chain of frames, following
+// indirect calls to every table entry of their type. Recursion and frames
+// of run-time size leave no bound.
+static void test_compute_stack_bound() {
+    {
+        Object o{"a.o"};
+        auto sp = o.import_global(stack_pointer_name);
+        auto v = o.type({});
+        auto iv = o.type({type_i32});
+        auto leaf = o.function(v, Body{}.prologue(sp, 32).op(instr_end));
+        auto mid =
+            o.function(v, Body{}.prologue(sp, 16).call(leaf).op(instr_end));
+        o.element(o.function(iv, Body{}.prologue(sp, 64).op(instr_end)));
+        o.element(o.function(iv, Body{}.prologue(sp, 8).op(instr_end)));
+        o.function(v,
+                   Body{}
+                       .prologue(sp, 48)
+                       .call(mid)
+                       .i32_const(0)
+                       .i32_const(0)
+                       .call_indirect(iv)
+                       .op(instr_end),
+                   "apply");
+
+        Linked linked;
+        linked.auto_stack_size = true;
+        auto& m = add(linked, o.build());
+        link(linked, {&m});
+        EXPECT(linked.stack_bound == 48 + 64);
+        EXPECT(linked.has_indirect_calls);
+        EXPECT(!linked.has_recursion && !linked.has_dynamic_frames);
+        auto& sp_module = *linked.modules[1]; // create_sp_export()
+        EXPECT(sp_module.symbols.count(stack_pointer_name));
+        EXPECT(sp_module.globals[0].init_u32 == linked.memory_size);
+        EXPECT(linked.memory_size % memory_alignment == 0);
+    }
+    {
+        Object o{"a.o"};
+        auto sp = o.import_global(stack_pointer_name);
+        auto v = o.type({});
+        auto self = o.num_imported_functions;
+        o.function(v, Body{}.prologue(sp, 16).call(self).op(instr_end),
+                   "apply");
+
+        Linked linked;
+        linked.auto_stack_size = true;
+        auto& m = add(linked, o.build());
+        link(linked, {&m}, 4096);
+        EXPECT(!linked.stack_bound);
+        EXPECT(linked.has_recursion);
+    }
+    {
+        Object o{"a.o"};
+        auto sp = o.import_global(stack_pointer_name);
+        auto iv = o.type({type_i32});
+        o.function(iv,
+                   Body{}
+                       .get_global(sp)
+                       .get_local(0)
+                       .op(instr_i32_sub)
+                       .set_global(sp)
+                       .op(instr_end),
+                   "apply");
+
+        Linked linked;
+        linked.auto_stack_size = true;
+        auto& m = add(linked, o.build());
+        link(linked, {&m}, 4096);
+        EXPECT(!linked.stack_bound);
+        EXPECT(linked.has_dynamic_frames);
+    }
+}
+
+// user-045: a clone links the same as the module it came from, and linking
+// it leaves the source as read_module() left it
+static void test_clone_module() {
+    Object o{"a.o"};
+    auto v = o.type({});
+    auto f = o.function(v, Body{}.op(instr_end), "f");
+    o.function(v, Body{}.call(f).op(instr_end), "apply");
+    o.data(".data.x", {1, 2, 3, 4}, "x", 0, 2);
+    auto source = o.build();
+    auto binary = source->binary;
+
+    Linked linked1, linked2;
+    auto& clone = add(linked1, clone_module(*source));
+    link(linked1, {&clone});
+    auto& clone2 = add(linked2, clone_module(*source));
+    link(linked2, {&clone2});
+    EXPECT(linked1.binary == linked2.binary);
+    EXPECT(source->binary == binary);
+    for (auto& [name, symbol] : source->symbols)
+        EXPECT(symbol.module == source.get() && !symbol.linked_symbol);
+    EXPECT(clone.symbols.at("f").module == &clone);
+    EXPECT(clone.functions[f].export_symbol == &clone.symbols.at("f"));
+}
+
+int main() {
+    try {
+        test_merge_data();
+        test_claim_comdats();
+        test_devirtualize();
+        test_compute_stack_bound();
+        test_clone_module();
+    } catch (exception& e) {
+        printf("error: %s\n", e.what());
+        return 1;
+    }
+    if (failures) {
+        printf("%d failed\n", failures);
+        return 1;
+    }
+    printf("all passed\n");
+    return 0;
+}
@@ -0,0 +1,60 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include "wasm-optimize.h"
+#include "wasm-tools.h"
+
+#include <binaryen-c.h>
+#include <mutex>
+
+namespace WasmTools {
+
+void optimize(std::vector<uint8_t>& binary, const OptimizeOptions& options) {
+    // The levels are global to binaryen, which also runs its passes on its
+    // own thread pool, so concurrent links take turns here
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock{mutex};
+    BinaryenSetOptimizeLevel(options.optimize_level);
+    BinaryenSetShrinkLevel(options.shrink_level);
+    auto module = BinaryenModuleRead((char*)binary.data(), binary.size());
+    try {
+        check(BinaryenModuleValidate(module), "optimizer input is invalid");
+        BinaryenModuleOptimize(module);
+
+        // BinaryenModuleWrite truncates; grow until the result fits
+        std::vector<uint8_t> result(binary.size() + 1024);
+        while (true) {
+            auto size = BinaryenModuleWrite(module, (char*)result.data(),
+                                            result.size());
+            if (size < result.size()) {
+                result.resize(size);
+                break;
+            }
+            result.resize(result.size() * 2);
+        }
+        binary = std::move(result);
+    } catch (...) {
+        BinaryenModuleDispose(module);
+        throw;
+    }
+    BinaryenModuleDispose(module);
+}
+
+} // namespace WasmTools
@@ -0,0 +1,38 @@
+// Copyright 2017-2018 Todd Fleming
+//
+// Permission is hereby granted, free of charge, to any person obtaining a
+// copy of this software and associated documentation files (the "Software"),
+// to deal in the Software without restriction, including without limitation
+// the rights to use, copy, modify, merge, publish, distribute, sublicense,
+// and/or sell copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+// DEALINGS IN THE SOFTWARE.
+
+#include <stdint.h>
+#include <vector>
+
+namespace WasmTools {
+
+// Levels match wasm-opt: optimize_level is -O0 through -O4; shrink_level 1
+// is -Os and 2 is -Oz. Passes run function-parallel in native builds.
+struct OptimizeOptions {
+    uint32_t optimize_level{2};
+    uint32_t shrink_level{1};
+};
+
+// Runs binaryen's default pipeline over a finished (non-relocatable)
+// module, replacing binary with the result. Safe to call from several
+// threads; the calls take turns.
+void optimize(std::vector<uint8_t>& binary, const OptimizeOptions& options);
+
+} // namespace WasmTools
@@ -19,7 +19,10 @@
 // DEALINGS IN THE SOFTWARE.
 
 #include "wasm-tools.h"
+#include <algorithm>
+#include <set>
 #include <stdio.h>
+#include <string.h>
 
 namespace WasmTools {
 
@@ -120,6 +123,58 @@ void push_init_expr32(std::vector<uint8_t>& binary, uint32_t value) {
     binary.push_back(instr_end);
 }
 
+// Returns the position after the instruction at pos
+size_t skip_instr(const std::vector<uint8_t>& binary, size_t pos) {
+    auto opcode = binary[pos++];
+    if ((opcode >= 0x45 && opcode <= 0xbf) || opcode == 0x00 ||
+        opcode == 0x01 || opcode == 0x05 || opcode == 0x0b ||
+        opcode == 0x0f || opcode == 0x1a || opcode == 0x1b)
+        return pos;
+    if ((opcode >= 0x02 && opcode <= 0x04) || opcode == 0x0c ||
+        opcode == 0x0d || opcode == 0x10 ||
+        (opcode >= 0x20 && opcode <= 0x24) ||
+        (opcode >= 0x3f && opcode <= 0x42)) {
+        read_leb(binary, pos);
+        return pos;
+    }
+    if (opcode == 0x11 || (opcode >= 0x28 && opcode <= 0x3e)) {
+        read_leb(binary, pos);
+        read_leb(binary, pos);
+        return pos;
+    }
+    if (opcode == 0x43)
+        return pos + 4;
+    if (opcode == 0x44)
+        return pos + 8;
+    if (opcode == 0x0e) {
+        auto count = read_leb(binary, pos);
+        for (uint32_t i = 0; i <= count; ++i)
+            read_leb(binary, pos);
+        return pos;
+    }
+    // Sign extension
+    if (opcode >= 0xc0 && opcode <= 0xc4)
+        return pos;
+    // Saturating truncation, bulk memory and table ops
+    if (opcode == 0xfc) {
+        auto op = read_leb(binary, pos);
+        uint32_t immediates = 0;
+        if (op <= 0x07)
+            immediates = 0;
+        else if (op == 0x08 || op == 0x0a || op == 0x0c || op == 0x0e)
+            immediates = 2;
+        else if (op <= 0x11)
+            immediates = 1;
+        else
+            check(false, "unsupported opcode 0xfc " + std::to_string(op));
+        for (uint32_t i = 0; i < immediates; ++i)
+            read_leb(binary, pos);
+        return pos;
+    }
+    check(false, "unsupported opcode " + std::to_string(opcode));
+    return pos;
+}
+
 ResizableLimits read_resizable_limits(const std::vector<uint8_t>& binary,
                                       size_t& pos) {
     auto max_present = !!(binary[pos++] & 1);
@@ -158,6 +213,20 @@ void push_sized_counted(std::vector<uint8_t>& binary, F f) {
     push_sized(binary, [&] { push_counted(binary, f); });
 }
 
+// Calls f(function_index, begin, end) for each body in the code section
+template <typename F> void for_each_body(const Module& module, F f) {
+    auto& sec = module.sections[sec_code];
+    if (!sec.valid)
+        return;
+    auto pos = sec.begin;
+    auto num_bodies = read_leb(module.binary, pos);
+    for (uint32_t i = 0; i < num_bodies; ++i) {
+        auto size = read_leb(module.binary, pos);
+        f(module.num_imported_functions + i, pos, pos + size);
+        pos += size;
+    }
+}
+
 void read_sec_type(Module& module, size_t& pos, size_t s_end) {
     if (debug_read)
         printf("type\n");
@@ -393,6 +462,17 @@ void read_sec_elem(Module& module, size_t& pos, size_t s_end) {
 void read_sec_code(Module& module, size_t& pos, size_t s_end) {
     if (debug_read)
         printf("code\n");
+    auto count = read_leb(module.binary, pos);
+    check(count == module.functions.size() - module.num_imported_functions,
+          "code section does not match function section");
+    for (uint32_t i = 0; i < count; ++i) {
+        auto size = read_leb(module.binary, pos);
+        auto& function = module.functions[module.num_imported_functions + i];
+        function.body_begin = pos;
+        function.body_end = pos + size;
+        pos += size;
+    }
+    check(pos == s_end, "code section malformed");
 }
 
 void read_sec_data(Module& module, size_t& pos, size_t s_end) {
@@ -430,6 +510,8 @@ void read_sec_name(Module& module, size_t& pos, size_t s_end) {
                     printf("        %d %s\n", index, std::string{name}.c_str());
                 check(index < module.functions.size(),
                       "invalid function index in name");
+                module.function_names.resize(module.functions.size());
+                module.function_names[index] = name;
             }
         } else {
             pos = sub_end;
@@ -486,6 +568,8 @@ void read_linking(Module& module, size_t& pos, size_t s_end) {
                 printf("    data_size: %d\n", module.data_size);
         } else if (type == link_segment_info) {
             auto count = read_leb(module.binary, pos);
+            check(count == module.data_segments.size(),
+                  "segment info does not match data section");
             for (uint32_t i = 0; i < count; ++i) {
                 auto name = read_str(module.binary, pos);
                 auto alignment = read_leb(module.binary, pos);
@@ -493,7 +577,13 @@ void read_linking(Module& module, size_t& pos, size_t s_end) {
                 if (debug_read)
                     printf("    segment %s alignment=%d flags=%d\n",
                            std::string{name}.c_str(), alignment, flags);
+                check(alignment < 32, "segment alignment out of range");
+                auto& segment = module.data_segments[i];
+                segment.name = name;
+                segment.alignment = alignment;
+                segment.flags = flags;
             }
+            module.has_segment_info = true;
         } else if (type == link_init_funcs) {
             auto count = read_leb(module.binary, pos);
             for (uint32_t i = 0; i < count; ++i) {
@@ -504,6 +594,37 @@ void read_linking(Module& module, size_t& pos, size_t s_end) {
                                      " out of range");
                 module.init_functions.push_back(InitFunction{priority, index});
             }
+        } else if (type == link_comdat_info) {
+            auto count = read_leb(module.binary, pos);
+            for (uint32_t i = 0; i < count; ++i) {
+                Comdat comdat{read_str(module.binary, pos)};
+                check(read_leb(module.binary, pos) == 0,
+                      "unsupported comdat flags");
+                auto num_entries = read_leb(module.binary, pos);
+                for (uint32_t j = 0; j < num_entries; ++j) {
+                    auto kind = read_leb(module.binary, pos);
+                    auto index = read_leb(module.binary, pos);
+                    if (kind == comdat_function) {
+                        check(index >= module.num_imported_functions &&
+                                  index < module.functions.size(),
+                              "comdat has invalid function index");
+                        comdat.functions.push_back(index);
+                    } else if (kind == comdat_data) {
+                        check(index < module.data_segments.size(),
+                              "comdat has invalid segment index");
+                        comdat.data_segments.push_back(index);
+                    } else {
+                        check(false, "unhandled comdat kind " +
+                                         std::to_string(kind));
+                    }
+                }
+                if (debug_read)
+                    printf("    comdat  %s functions=%zu segments=%zu\n",
+                           std::string{comdat.name}.c_str(),
+                           comdat.functions.size(),
+                           comdat.data_segments.size());
+                module.comdats.push_back(std::move(comdat));
+            }
         } else {
             check(false,
                   "unhandled linking subsection " + std::to_string(type));
@@ -535,10 +656,13 @@ void prepare_symbols(Module& module) {
         if (symbol.export_index) {
             auto& exp = module.exports[*symbol.export_index];
             if (exp.kind == external_global) {
+                module.globals[exp.index].export_symbol = &symbol;
                 module.globals[exp.index].has_symbols = true;
                 symbol.export_global_index = exp.index;
-            } else if (exp.kind == external_function)
+            } else if (exp.kind == external_function) {
+                module.functions[exp.index].export_symbol = &symbol;
                 symbol.export_function_index = exp.index;
+            }
         }
         if ((symbol.import_global_index || symbol.export_global_index) &&
             (symbol.import_function_index || symbol.export_function_index))
@@ -610,6 +734,8 @@ void read_module(Module& module) {
                 read_reloc(module, name, pos, s_end);
             else if (name == "linking")
                 read_linking(module, pos, s_end);
+            else if (name == "name")
+                read_sec_name(module, pos, s_end);
         }
         pos = s_end;
     } // while (pos != end)
@@ -617,6 +743,31 @@ void read_module(Module& module) {
     prepare_symbols(module);
 } // read_module
 
+std::unique_ptr<Module> clone_module(const Module& source) {
+    auto module = std::make_unique<Module>(source);
+    std::map<const Symbol*, Symbol*> symbols;
+    auto it = source.symbols.begin();
+    for (auto& [name, symbol] : module->symbols) {
+        check(!symbol.linked_symbol,
+              source.filename + ": can't clone a module after linking");
+        symbol.module = module.get();
+        symbols[&(it++)->second] = &symbol;
+    }
+    auto rebind = [&](Symbol*& symbol) {
+        if (symbol)
+            symbol = symbols[symbol];
+    };
+    for (auto& function : module->functions) {
+        rebind(function.import_symbol);
+        rebind(function.export_symbol);
+    }
+    for (auto& global : module->globals) {
+        rebind(global.import_symbol);
+        rebind(global.export_symbol);
+    }
+    return module;
+} // clone_module
+
 Symbol* create_sp_export(Linked& linked) {
     linked.modules.push_back(std::make_unique<Module>());
     auto& module = *linked.modules.back();
@@ -646,6 +797,120 @@ Module& create_start_function(Linked& linked) {
     return module;
 }
 
+Module& create_profile_function(Linked& linked) {
+    linked.modules.push_back(std::make_unique<Module>());
+    auto& module = *linked.modules.back();
+    module.filename = "__profile__module";
+    module.function_types.push_back(FunctionType{{}, {type_i32}});
+    if (linked.instrument_time) {
+        module.function_types.push_back(FunctionType{{}, {type_f64}});
+        module.imports.push_back(Import{clock_function_name,
+                                        external_function, 0});
+        module.functions.push_back(Function{1});
+        module.num_imported_functions = 1;
+        auto& symbol = module.symbols[clock_function_name];
+        symbol.module = &module;
+        symbol.import_index = 0;
+    }
+    module.exports.push_back(Export{profile_function_name, external_function,
+                                    uint32_t(module.functions.size())});
+    module.functions.push_back(Function{0});
+    auto& symbol = module.symbols[profile_function_name];
+    symbol.module = &module;
+    symbol.export_index = 0;
+    prepare_symbols(module);
+    linked.profile_module = &module;
+    return module;
+}
+
+char signature_char(uint8_t type) {
+    switch (type) {
+    case type_i32:
+        return 'i';
+    case type_i64:
+        return 'j';
+    case type_f32:
+        return 'f';
+    case type_f64:
+        return 'd';
+    default:
+        check(false, "unknown value type " + std::string{type_str(type)});
+        return 0;
+    }
+}
+
+// Emscripten's glue calls function pointers through dynCall_<sig> exports,
+// e.g. dynCall_vii(f, a, b). Synthesize one for each signature in the
+// table, unless an input already defines it. Signatures with i64 are left
+// out since JS can't pass i64.
+Module& create_dyncall_thunks(Linked& linked) {
+    std::set<FunctionType> types;
+    for (auto& m : linked.modules)
+        for (auto& element : m->elements)
+            types.insert(
+                m->function_types[m->functions[element.function_index].type]);
+
+    linked.modules.push_back(std::make_unique<Module>());
+    auto& module = *linked.modules.back();
+    module.filename = "__dyncall__module";
+    auto& binary = module.binary;
+    push_counted(binary, [&] {
+        for (auto& type : types) {
+            std::string name = "dynCall_";
+            name += type.return_types.empty()
+                        ? 'v'
+                        : signature_char(type.return_types[0]);
+            for (auto arg : type.arg_types)
+                name += signature_char(arg);
+            if (name.find('j') != std::string::npos)
+                continue;
+            auto defined = std::any_of(
+                linked.modules.begin(), linked.modules.end(), [&](auto& m) {
+                    auto it = m->symbols.find(name);
+                    return it != m->symbols.end() && it->second.export_index;
+                });
+            if (defined)
+                continue;
+
+            auto thunk_type = type;
+            thunk_type.arg_types.insert(thunk_type.arg_types.begin(), type_i32);
+            module.function_types.push_back(thunk_type);
+            module.function_types.push_back(type);
+            auto& exported_name = module.synthetic_names.emplace_back(name);
+            module.exports.push_back(
+                Export{exported_name, external_function,
+                       uint32_t(module.functions.size())});
+            auto& symbol = module.symbols[exported_name];
+            symbol.module = &module;
+            symbol.export_index = module.exports.size() - 1;
+            module.functions.push_back(
+                Function{uint32_t(module.function_types.size() - 2)});
+
+            push_sized(binary, [&] {
+                push_leb5(binary, 0); // local_count
+                for (uint32_t i = 1; i < thunk_type.arg_types.size(); ++i) {
+                    binary.push_back(instr_get_local);
+                    push_leb5(binary, i);
+                }
+                binary.push_back(instr_get_local);
+                push_leb5(binary, 0);
+                binary.push_back(instr_call_indirect);
+                module.relocs.push_back(
+                    Reloc{sec_code, reloc_type_index_leb,
+                          uint32_t(binary.size()),
+                          uint32_t(module.function_types.size() - 1)});
+                push_leb5(binary, module.function_types.size() - 1);
+                binary.push_back(0); // reserved
+                binary.push_back(instr_end);
+            });
+        }
+        return module.functions.size();
+    });
+    module.sections[sec_code] = Section{true, 0, binary.size()};
+    prepare_symbols(module);
+    return module;
+}
+
 template <typename F> void for_each_public_linked_symbol(Linked& linked, F f) {
     for (auto& [key, linked_symbol] : linked.linked_symbols) {
         auto& [module, name] = key;
@@ -714,9 +979,69 @@ void link_symbols(Linked& linked) {
     }
 } // link_symbols
 
+// The first marked module to contain a comdat keeps it. The other copies
+// are discarded, and their symbols resolve to the kept copy.
+void claim_comdats(Linked& linked, Module& module) {
+    auto for_each_global = [&](auto& segment, auto f) {
+        for (auto i = module.num_imported_globals; i < module.globals.size();
+             ++i) {
+            auto& global = module.globals[i];
+            if (global.is_memory_address && global.init_u32 >= segment.offset &&
+                global.init_u32 < segment.offset + segment.size)
+                f(global);
+        }
+    };
+
+    for (auto& comdat : module.comdats) {
+        auto [it, inserted] =
+            linked.comdat_owners.insert({comdat.name, &module});
+        if (inserted) {
+            auto claim = [](Symbol* symbol) {
+                if (symbol && symbol->linked_symbol)
+                    symbol->linked_symbol->definition = symbol;
+            };
+            for (auto index : comdat.functions)
+                claim(module.functions[index].export_symbol);
+            for (auto index : comdat.data_segments)
+                for_each_global(module.data_segments[index], [&](auto& global) {
+                    claim(global.export_symbol);
+                });
+            continue;
+        }
+        for (auto index : comdat.functions)
+            module.functions[index].is_discarded = true;
+
+        // Data which is only reachable through local symbols can't be
+        // redirected, so it stays.
+        for (auto index : comdat.data_segments) {
+            auto& segment = module.data_segments[index];
+            bool redirectable = true;
+            for_each_global(segment, [&](auto& global) {
+                if (!global.export_symbol ||
+                    (global.export_symbol->flags & sym_binding_local))
+                    redirectable = false;
+            });
+            if (!redirectable)
+                continue;
+            segment.is_discarded = true;
+            for_each_global(segment,
+                            [&](auto& global) { global.is_discarded = true; });
+        }
+        auto& inits = module.init_functions;
+        inits.erase(std::remove_if(inits.begin(), inits.end(),
+                                   [&](auto& init) {
+                                       return module.functions[init.index]
+                                           .is_discarded;
+                                   }),
+                    inits.end());
+    }
+} // claim_comdats
+
 void mark_all(Linked& linked) {
-    for (auto& module : linked.modules)
+    for (auto& module : linked.modules) {
         module->is_marked = true;
+        claim_comdats(linked, *module);
+    }
     for (auto& [key, linked_symbol] : linked.linked_symbols) {
         linked_symbol.is_marked = true;
         linked_symbol.is_marked_export = true;
@@ -749,6 +1074,7 @@ void mark_module(Linked& linked, Module& module,
         return;
     // printf("mark: %s\n", std::string{module.filename}.c_str());
     module.is_marked = true;
+    claim_comdats(linked, module);
     for (uint32_t i = 0; i < module.num_imported_globals; ++i)
         add_symbol_to_queue(
             linked, module.globals[i].import_symbol->linked_symbol, queue);
@@ -801,16 +1127,213 @@ void map_function_types(Linked& linked) {
     }
 } // map_function_types
 
+uint32_t align(uint32_t offset, uint32_t alignment) {
+    return (offset + alignment - 1) & -alignment;
+}
+
+bool starts_with(std::string_view s, std::string_view prefix) {
+    return s.substr(0, prefix.size()) == prefix;
+}
+
+// Mergeable segments may not contain relocs; the copies are compared before
+// relocate() runs.
+bool has_data_reloc(const Module& module, const DataSegment& segment) {
+    auto& section = module.sections[sec_data];
+    for (auto& reloc : module.relocs) {
+        auto pos = section.begin + reloc.offset;
+        if (reloc.section_id == sec_data && pos >= segment.data_begin &&
+            pos < segment.data_begin + segment.size)
+            return true;
+    }
+    return false;
+}
+
+bool is_mergeable(const Module& module, const DataSegment& segment) {
+    if (!module.has_segment_info || !segment.size)
+        return false;
+    if (!(segment.flags & seg_flag_strings) &&
+        !starts_with(segment.name, ".rodata.str") &&
+        !starts_with(segment.name, ".rodata.cst"))
+        return false;
+    return !has_data_reloc(module, segment);
+}
+
+// Strings are merged individually, which allows tail merging. Everything
+// else is merged as a whole segment.
+bool is_merged_by_string(const Module& module, const DataSegment& segment) {
+    return segment.alignment == 0 &&
+           ((segment.flags & seg_flag_strings) ||
+            starts_with(segment.name, ".rodata.str1.1")) &&
+           !module.binary[segment.data_begin + segment.size - 1];
+}
+
+void merge_data(Linked& linked, uint32_t& memory_offset) {
+    struct Piece {
+        Module* module;
+        uint32_t offset;
+        uint32_t data_begin;
+        uint32_t size;
+        uint32_t alignment;
+    };
+    auto content = [](const Piece& p) {
+        return std::string_view{(char*)&p.module->binary[p.data_begin],
+                                p.size};
+    };
+
+    std::vector<Piece> strings;
+    std::vector<Piece> constants;
+    for (auto& module : linked.modules) {
+        if (!module->is_marked)
+            continue;
+        for (auto& segment : module->data_segments) {
+            if (!segment.is_merged)
+                continue;
+            if (is_merged_by_string(*module, segment)) {
+                auto begin = uint32_t{0};
+                for (uint32_t i = 0; i < segment.size; ++i) {
+                    if (module->binary[segment.data_begin + i])
+                        continue;
+                    strings.push_back(
+                        Piece{&*module, segment.offset + begin,
+                              segment.data_begin + begin, i + 1 - begin, 0});
+                    begin = i + 1;
+                }
+            } else {
+                constants.push_back(Piece{&*module, segment.offset,
+                                          segment.data_begin, segment.size,
+                                          segment.alignment});
+            }
+        }
+    }
+
+    auto add = [&](const Piece& p, uint32_t final_address) {
+        p.module->data_pieces.push_back(
+            DataPiece{p.offset, p.size, final_address});
+    };
+
+    // Identical constants share a single copy
+    std::map<std::tuple<uint32_t, std::string_view>, uint32_t> constant_map;
+    for (auto& p : constants) {
+        auto address = align(memory_offset, 1u << p.alignment);
+        auto [it, inserted] =
+            constant_map.insert({{p.alignment, content(p)}, address});
+        if (inserted) {
+            memory_offset = it->second + p.size;
+            linked.merged_data.push_back(
+                MergedData{p.module, p.data_begin, p.size, it->second});
+        }
+        add(p, it->second);
+    }
+
+    // Sorting by reversed content puts each string directly before the
+    // strings it's a suffix of. Walking backwards, a string either is a
+    // suffix of the last string emitted, or starts a new one.
+    auto reversed = [&](const Piece& p) {
+        auto s = content(p);
+        return std::string{s.rbegin(), s.rend()};
+    };
+    std::vector<std::tuple<std::string, size_t>> order;
+    for (size_t i = 0; i < strings.size(); ++i)
+        order.emplace_back(reversed(strings[i]), i);
+    std::sort(order.begin(), order.end());
+    const Piece* leader = nullptr;
+    uint32_t leader_address = 0;
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        auto& p = strings[std::get<1>(*it)];
+        auto s = content(p);
+        if (leader && s.size() <= leader->size &&
+            content(*leader).substr(leader->size - s.size()) == s) {
+            add(p, leader_address + leader->size - p.size);
+            continue;
+        }
+        leader = &p;
+        leader_address = memory_offset;
+        memory_offset += p.size;
+        linked.merged_data.push_back(
+            MergedData{p.module, p.data_begin, p.size, leader_address});
+        add(p, leader_address);
+    }
+} // merge_data
+
 void allocate_memory(Linked& linked, uint32_t memory_offset) {
     for (auto& module : linked.modules) {
         if (!module->is_marked)
             continue;
         module->memory_offset = memory_offset;
-        memory_offset =
-            (memory_offset + module->data_size + memory_alignment - 1) &
-            -memory_alignment;
+        bool compact = false;
+        for (auto& segment : module->data_segments) {
+            segment.is_merged =
+                !segment.is_discarded && is_mergeable(*module, segment);
+            if (segment.is_merged || segment.is_discarded)
+                compact = true;
+        }
+        if (!compact) {
+            memory_offset = align(memory_offset + module->data_size,
+                                  memory_alignment);
+            continue;
+        }
+
+        // Compact the segments which stay, leaving out the merged and
+        // discarded ones
+        auto segments_end = uint32_t{0};
+        for (auto& segment : module->data_segments) {
+            segments_end =
+                std::max(segments_end, segment.offset + segment.size);
+            if (segment.is_merged || segment.is_discarded)
+                continue;
+            memory_offset = align(memory_offset, 1u << segment.alignment);
+            module->data_pieces.push_back(
+                DataPiece{segment.offset, segment.size, memory_offset});
+            memory_offset += segment.size;
+        }
+        if (module->data_size > segments_end) {
+            module->data_pieces.push_back(
+                DataPiece{segments_end, module->data_size - segments_end,
+                          memory_offset});
+            memory_offset += module->data_size - segments_end;
+        }
+        memory_offset = align(memory_offset, memory_alignment);
     }
-    linked.memory_size = memory_offset;
+
+    merge_data(linked, memory_offset);
+    for (auto& module : linked.modules)
+        std::sort(module->data_pieces.begin(), module->data_pieces.end(),
+                  [](auto& a, auto& b) { return a.offset < b.offset; });
+    linked.memory_size = align(memory_offset, memory_alignment);
+} // allocate_memory
+
+uint32_t translate_address(const Module& module, uint32_t address,
+                           uint32_t addend) {
+    auto& pieces = module.data_pieces;
+    auto it = std::upper_bound(
+        pieces.begin(), pieces.end(), address,
+        [](uint32_t address, auto& piece) { return address < piece.offset; });
+    if (it == pieces.begin())
+        return module.memory_offset + address + addend;
+    --it;
+    if (addend && (address + addend < it->offset ||
+                   address + addend > it->offset + it->size))
+        return translate_address(module, address + addend, 0);
+    return it->final_address + address + addend - it->offset;
+}
+
+// Reserve the profile table after the rest of memory. Every defined
+// function gets an entry, in final index order.
+void allocate_profile(Linked& linked) {
+    if (!linked.instrument)
+        return;
+    linked.num_profiled_functions = 0;
+    for (auto& module : linked.modules)
+        if (module->is_marked)
+            for (auto i = module->num_imported_functions;
+                 i < module->functions.size(); ++i)
+                if (!module->functions[i].is_discarded)
+                    ++linked.num_profiled_functions;
+    linked.profile_offset = align(linked.memory_size, 8);
+    linked.memory_size =
+        align(linked.profile_offset + profile_header_size +
+                  linked.num_profiled_functions * profile_entry_size,
+              memory_alignment);
 }
 
 void allocate_functions(Linked& linked) {
@@ -822,8 +1345,11 @@ void allocate_functions(Linked& linked) {
         if (!module->is_marked)
             continue;
         module->function_offset = function_offset;
-        function_offset +=
-            module->functions.size() - module->num_imported_functions;
+        module->replacement_functions.resize(module->functions.size(), -1);
+        for (auto i = module->num_imported_functions;
+             i < module->functions.size(); ++i)
+            if (!module->functions[i].is_discarded)
+                module->replacement_functions[i] = function_offset++;
     }
     for (auto& [key, linked_symbol] : linked.linked_symbols) {
         auto& [module, name] = key;
@@ -834,30 +1360,42 @@ void allocate_functions(Linked& linked) {
         check(*definition->export_function_index >=
                   definition->module->num_imported_functions,
               "function export malfunction");
-        linked_symbol.final_index = *definition->export_function_index -
-                                    definition->module->num_imported_functions +
-                                    definition->module->function_offset;
+        if (definition->module->functions[*definition->export_function_index]
+                .is_discarded) {
+            check(module, "symbol " + std::string{name} +
+                              " is defined in a discarded comdat in " +
+                              definition->module->filename);
+            continue;
+        }
+        linked_symbol.final_index =
+            definition->module
+                ->replacement_functions[*definition->export_function_index];
         if (!module)
             linked.export_functions.push_back(&linked_symbol);
     }
     for (auto& module : linked.modules) {
         if (!module->is_marked)
             continue;
-        module->replacement_functions.resize(module->functions.size());
-        uint32_t i = 0;
-        for (; i < module->num_imported_functions; ++i) {
+        for (uint32_t i = 0; i < module->functions.size(); ++i) {
             auto& function = module->functions[i];
-            check(function.import_symbol, "missing function.import_symbol");
-            check(function.import_symbol->linked_symbol,
-                  "missing function.import_symbol->linked_symbol");
-            check(!!function.import_symbol->linked_symbol->final_index,
-                  "missing function.import_symbol->linked_symbol->final_index");
+            Symbol* symbol;
+            if (i < module->num_imported_functions) {
+                check(function.import_symbol,
+                      "missing function.import_symbol");
+                symbol = function.import_symbol;
+            } else if (function.is_discarded && function.export_symbol &&
+                       !(function.export_symbol->flags & sym_binding_local)) {
+                symbol = function.export_symbol;
+            } else {
+                continue;
+            }
+            check(symbol->linked_symbol,
+                  "missing function symbol->linked_symbol");
+            check(!!symbol->linked_symbol->final_index,
+                  "missing function symbol->linked_symbol->final_index");
             module->replacement_functions[i] =
-                *function.import_symbol->linked_symbol->final_index;
+                *symbol->linked_symbol->final_index;
         }
-        for (; i < module->functions.size(); ++i)
-            module->replacement_functions[i] =
-                module->function_offset + i - module->num_imported_functions;
     }
 } // allocate_functions
 
@@ -882,6 +1420,18 @@ bool fill_start_function_code(Linked& linked, Module& module) {
     return !init_functions.empty();
 }
 
+void fill_profile_function_code(Linked& linked, Module& module) {
+    auto& binary = module.binary;
+    push_leb5(binary, 1); // count
+    push_sized(binary, [&] {
+        push_leb5(binary, 0); // local_count
+        binary.push_back(instr_i32_const);
+        push_leb5(binary, linked.profile_offset);
+        binary.push_back(instr_end);
+    });
+    module.sections[sec_code] = Section{true, 0, binary.size()};
+}
+
 void allocate_code(Linked& linked) {
     uint32_t code_offset = 0;
     for (auto& module : linked.modules) {
@@ -916,6 +1466,7 @@ void allocate_globals(Linked& linked) {
         if (!module->is_marked)
             continue;
         module->replacement_addresses.resize(module->globals.size());
+        module->original_addresses.resize(module->globals.size());
         module->replacement_globals.resize(module->globals.size());
         uint32_t i = 0;
         for (; i < module->num_imported_globals; ++i) {
@@ -930,33 +1481,149 @@ void allocate_globals(Linked& linked) {
                     definition->module
                         ->globals[*definition->export_global_index]
                         .init_u32;
+                module->original_addresses[i] = {definition->module,
+                                                 orig_address};
                 module->replacement_addresses[i] =
-                    orig_address + definition->module->memory_offset;
+                    translate_address(*definition->module, orig_address, 0);
             }
             module->replacement_globals[i] = *linked_symbol->final_index;
         }
-        for (; i < module->globals.size(); ++i)
+        for (; i < module->globals.size(); ++i) {
+            auto& global = module->globals[i];
+            if (global.is_discarded) {
+                auto definition = global.export_symbol->linked_symbol
+                                      ? global.export_symbol->linked_symbol
+                                            ->definition
+                                      : nullptr;
+                check(definition && definition != global.export_symbol,
+                      "discarded global has no replacement in " +
+                          module->filename);
+                auto& def_global =
+                    definition->module
+                        ->globals[*definition->export_global_index];
+                module->original_addresses[i] = {definition->module,
+                                                 def_global.init_u32};
+                module->replacement_addresses[i] = translate_address(
+                    *definition->module, def_global.init_u32, 0);
+                continue;
+            }
+            module->original_addresses[i] = {&*module, global.init_u32};
             module->replacement_addresses[i] =
-                module->globals[i].init_u32 + module->memory_offset;
+                translate_address(*module, global.init_u32, 0);
+        }
     }
 } // allocate_globals
 
-void allocate_elements(Linked& linked, uint32_t element_offset) {
-    linked.element_offset = element_offset;
+uint32_t get_element_type(const Module& module, const Element& element) {
+    return module.replacement_function_types
+        [module.functions[element.function_index].type];
+}
+
+// Rewrites each call_indirect whose type has exactly one table entry into
+// drop; call. Both forms are 7 bytes once the type index reloc is padded,
+// so the rewrite is in place. A call through a bad pointer of that type
+// reaches the lone target instead of trapping. Counts the call_indirects
+// which remain, for drop_unused_elements.
+void devirtualize(Linked& linked) {
+    std::map<uint32_t, std::set<uint32_t>> targets;
+    for (auto& module : linked.modules)
+        if (module->is_marked)
+            for (auto& element : module->elements)
+                targets[get_element_type(*module, element)].insert(
+                    module->replacement_functions[element.function_index]);
+
     for (auto& module : linked.modules) {
         if (!module->is_marked)
             continue;
-        module->replacement_elements.reserve(module->elements.size());
-        for (auto& element : module->elements) {
-            auto function_index =
-                module->replacement_functions[element.function_index];
-            auto [it, inserted] = linked.function_element_map.insert(
-                {function_index, linked.elements.size() + element_offset});
-            if (inserted)
-                linked.elements.push_back(function_index);
-            module->replacement_elements.push_back(it->second);
+        auto& binary = module->binary;
+        auto code_begin = module->sections[sec_code].begin;
+        std::set<uint32_t> removed_relocs;
+        for (auto i = module->num_imported_functions;
+             i < module->functions.size(); ++i) {
+            auto& function = module->functions[i];
+            if (function.is_discarded ||
+                function.body_begin == function.body_end)
+                continue;
+            size_t pos = function.body_begin;
+            auto num_groups = read_leb(binary, pos);
+            for (uint32_t j = 0; j < num_groups; ++j) {
+                read_leb(binary, pos);
+                ++pos;
+            }
+            while (pos < function.body_end) {
+                auto next = skip_instr(binary, pos);
+                if (binary[pos] != instr_call_indirect) {
+                    pos = next;
+                    continue;
+                }
+                auto type_pos = pos + 1;
+                auto type_index = read_leb(binary, type_pos);
+                check(type_index < module->function_types.size(),
+                      "call_indirect has invalid type index in " +
+                          module->filename);
+                auto type = module->replacement_function_types[type_index];
+                auto it = targets.find(type);
+                if (linked.devirtualize && it != targets.end() &&
+                    it->second.size() == 1 && next - pos == 7) {
+                    binary[pos] = instr_drop;
+                    binary[pos + 1] = instr_call;
+                    write_leb5(binary, pos + 2, *it->second.begin());
+                    removed_relocs.insert(pos + 1 - code_begin);
+                } else {
+                    ++linked.indirect_call_counts[type];
+                }
+                pos = next;
+            }
         }
+        if (!removed_relocs.empty())
+            module->relocs.erase(
+                std::remove_if(module->relocs.begin(), module->relocs.end(),
+                               [&](auto& reloc) {
+                                   return reloc.section_id == sec_code &&
+                                          reloc.type == reloc_type_index_leb &&
+                                          removed_relocs.count(reloc.offset);
+                               }),
+                module->relocs.end());
     }
+} // devirtualize
+
+void allocate_elements(Linked& linked, uint32_t element_offset) {
+    linked.element_offset = element_offset;
+
+    // Dropped functions get indices past the end of the table. Their
+    // addresses stay unique, and calling one traps as it would have on a
+    // type mismatch.
+    auto num_dropped = uint32_t{0};
+    auto allocate = [&](bool live) {
+        for (auto& module : linked.modules) {
+            if (!module->is_marked)
+                continue;
+            module->replacement_elements.resize(module->elements.size());
+            for (size_t i = 0; i < module->elements.size(); ++i) {
+                auto& element = module->elements[i];
+                auto function_index =
+                    module->replacement_functions[element.function_index];
+                check(function_index != uint32_t(-1),
+                      "table refers to discarded function in " +
+                          module->filename);
+                if (linked.drop_unused_elements &&
+                    !!linked.indirect_call_counts.count(
+                        get_element_type(*module, element)) != live)
+                    continue;
+                auto [it, inserted] = linked.function_element_map.insert(
+                    {function_index,
+                     linked.elements.size() + num_dropped + element_offset});
+                if (inserted && live)
+                    linked.elements.push_back(function_index);
+                else if (inserted)
+                    ++num_dropped;
+                module->replacement_elements[i] = it->second;
+            }
+        }
+    };
+    allocate(true);
+    if (linked.drop_unused_elements)
+        allocate(false);
 }
 
 void relocate(Linked& linked, Module& module) {
@@ -970,9 +1637,11 @@ void relocate(Linked& linked, Module& module) {
             check(reloc.index < module.globals.size(),
                   "reloc invalid global index");
             auto replacement = module.replacement_addresses[reloc.index];
-            if (replacement)
-                f(*replacement + reloc.addend);
-            else {
+            if (replacement) {
+                auto [def_module, address] =
+                    module.original_addresses[reloc.index];
+                f(translate_address(*def_module, address, reloc.addend));
+            } else {
                 check(reloc.section_id == sec_code,
                       "unresolved memory reloc not in code");
                 // I thought I'd need to forward some memory relocs
@@ -1059,6 +1728,112 @@ void relocate(Linked& linked) {
             relocate(linked, *module);
 }
 
+// Worst-case stack use over the call graph. Runs after relocate(), so
+// bodies hold final function, type, and global indices. A frame is the
+// constant in a "get_global sp; i32.const N; i32.sub" prologue. An
+// indirect call may reach any table entry of its type. Recursion and
+// frames of run-time size leave stack_bound empty.
+void compute_stack_bound(Linked& linked, uint32_t sp_index) {
+    struct Node {
+        uint32_t frame{};
+        std::vector<uint32_t> callees{};
+        std::set<uint32_t> indirect_types{};
+        uint32_t depth{};
+        uint8_t state{}; // 0: unvisited, 1: in progress, 2: done
+    };
+    std::vector<Node> nodes;
+    std::map<uint32_t, std::vector<uint32_t>> table;
+    for (auto& module : linked.modules) {
+        if (!module->is_marked)
+            continue;
+        for (auto& element : module->elements)
+            table[get_element_type(*module, element)].push_back(
+                module->replacement_functions[element.function_index]);
+        for_each_body(*module, [&](uint32_t i, size_t pos, size_t end) {
+            if (module->functions[i].is_discarded)
+                return;
+            auto index = module->replacement_functions[i];
+            if (index >= nodes.size())
+                nodes.resize(index + 1);
+            auto& node = nodes[index];
+            auto& binary = module->binary;
+            auto num_groups = read_leb(binary, pos);
+            for (uint32_t j = 0; j < num_groups; ++j) {
+                read_leb(binary, pos);
+                ++pos;
+            }
+            auto sp_state = 0; // 1: after get_global sp, 2: then i32.const
+            auto constant = uint32_t{0};
+            auto sp_pending = false; // sp was read, not yet adjusted
+            auto sp_dynamic = false; // sp adjusted by a run-time amount
+            while (pos < end) {
+                auto opcode = binary[pos];
+                auto imm = pos + 1;
+                auto next = skip_instr(binary, pos);
+                pos = next;
+                if (opcode == instr_get_global &&
+                    read_leb(binary, imm) == sp_index) {
+                    sp_state = 1;
+                    sp_pending = true;
+                    sp_dynamic = false;
+                    continue;
+                }
+                if (opcode == instr_i32_const && sp_state == 1) {
+                    sp_state = 2;
+                    constant = read_leb(binary, imm);
+                    continue;
+                }
+                if (opcode == instr_i32_sub && sp_state == 2) {
+                    node.frame += constant;
+                    sp_pending = false;
+                } else if (opcode == instr_i32_sub && sp_pending) {
+                    sp_dynamic = true;
+                    sp_pending = false;
+                } else if (opcode == instr_set_global &&
+                           read_leb(binary, imm) == sp_index) {
+                    if (sp_dynamic)
+                        linked.has_dynamic_frames = true;
+                    sp_pending = false;
+                    sp_dynamic = false;
+                } else if (opcode == instr_call) {
+                    node.callees.push_back(read_leb(binary, imm));
+                } else if (opcode == instr_call_indirect) {
+                    node.indirect_types.insert(read_leb(binary, imm));
+                    linked.has_indirect_calls = true;
+                }
+                sp_state = 0;
+            }
+        });
+    }
+
+    auto depth = [&](auto& self, uint32_t index) -> uint32_t {
+        if (index >= nodes.size())
+            return 0; // import
+        auto& node = nodes[index];
+        if (node.state == 2)
+            return node.depth;
+        if (node.state == 1) {
+            linked.has_recursion = true;
+            return 0;
+        }
+        node.state = 1;
+        auto deepest = uint32_t{0};
+        for (auto callee : node.callees)
+            deepest = std::max(deepest, self(self, callee));
+        for (auto type : node.indirect_types)
+            for (auto target : table[type])
+                deepest = std::max(deepest, self(self, target));
+        node.depth = node.frame + deepest;
+        node.state = 2;
+        return node.depth;
+    };
+    auto bound = uint32_t{0};
+    for (uint32_t i = 0; i < nodes.size(); ++i)
+        bound = std::max(bound, depth(depth, i));
+    if (!linked.has_recursion && !linked.has_dynamic_frames)
+        linked.stack_bound = bound;
+} // compute_stack_bound
+
 void fill_header(Linked& linked) {
     linked.binary.resize(8);
     write_i32(linked.binary, 0, 0x6d736100);
@@ -1154,6 +1929,8 @@ void push_sec_function(Linked& linked) {
             for (auto i = module->num_imported_functions;
                  i < module->functions.size(); ++i) {
                 auto& function = module->functions[i];
+                if (function.is_discarded)
+                    continue;
                 push_leb5(binary,
                           module->replacement_function_types[function.type]);
                 ++count;
@@ -1250,7 +2027,168 @@ void push_sec_elem(Linked& linked) {
     });
 }
 
+// Copy a function body, wrapping it with code which updates its profile
+// entry. The original body runs inside a block so returns become branches
+// to the exit code.
+void push_instrumented_body(Linked& linked, const Module& module,
+                            const FunctionType& type, size_t pos, size_t end,
+                            uint32_t entry) {
+    auto& binary = linked.binary;
+    auto& src = module.binary;
+    auto table = linked.profile_offset;
+    auto timed = linked.instrument_time;
+
+    auto push_i32_const = [&](uint32_t value) {
+        binary.push_back(instr_i32_const);
+        push_leb5(binary, value);
+    };
+    auto push_memory = [&](uint8_t opcode, uint32_t align, uint32_t offset) {
+        binary.push_back(opcode);
+        push_leb5(binary, align);
+        push_leb5(binary, offset);
+    };
+    auto push_local = [&](uint8_t opcode, uint32_t index) {
+        binary.push_back(opcode);
+        push_leb5(binary, index);
+    };
+    auto push_clock = [&] {
+        binary.push_back(instr_call);
+        push_leb5(binary, linked.profile_module->replacement_functions[0]);
+    };
+
+    auto num_groups = read_leb(src, pos);
+    auto num_locals = uint32_t(type.arg_types.size());
+    push_leb5(binary, num_groups + timed);
+    for (uint32_t i = 0; i < num_groups; ++i) {
+        auto n = read_leb(src, pos);
+        num_locals += n;
+        push_leb5(binary, n);
+        binary.push_back(src[pos++]);
+    }
+    auto elapsed = num_locals;
+    auto saved_child = num_locals + 1;
+    if (timed) {
+        push_leb5(binary, 2);
+        binary.push_back(type_f64);
+    }
+
+    // ++calls
+    push_i32_const(entry);
+    push_i32_const(entry);
+    push_memory(instr_i32_load, 2, 16);
+    push_i32_const(1);
+    binary.push_back(instr_i32_add);
+    push_memory(instr_i32_store, 2, 16);
+    if (timed) {
+        // saved_child = child_time; child_time = 0; elapsed = clock()
+        push_i32_const(table);
+        push_memory(instr_f64_load, 3, 8);
+        push_local(instr_set_local, saved_child);
+        push_i32_const(table);
+        binary.push_back(instr_f64_const);
+        binary.insert(binary.end(), 8, 0);
+        push_memory(instr_f64_store, 3, 8);
+        push_clock();
+        push_local(instr_set_local, elapsed);
+    }
+
+    binary.push_back(instr_block);
+    binary.push_back(type.return_types.empty() ? type_block
+                                               : type.return_types[0]);
+    uint32_t depth = 0;
+    while (true) {
+        check(pos < end, "function body missing end");
+        auto opcode = src[pos];
+        if (opcode == instr_end && !depth) {
+            check(pos + 1 == end, "function body has data after end");
+            break;
+        }
+        if (opcode == instr_return) {
+            binary.push_back(instr_br);
+            push_leb5(binary, depth);
+            ++pos;
+            continue;
+        }
+        if (opcode == instr_block || opcode == instr_loop ||
+            opcode == instr_if)
+            ++depth;
+        else if (opcode == instr_end)
+            --depth;
+        auto next = skip_instr(src, pos);
+        binary.insert(binary.end(), src.begin() + pos, src.begin() + next);
+        pos = next;
+    }
+    binary.push_back(instr_end);
+
+    if (timed) {
+        // elapsed = clock() - start
+        push_clock();
+        push_local(instr_get_local, elapsed);
+        binary.push_back(instr_f64_sub);
+        push_local(instr_set_local, elapsed);
+        // self_time += elapsed - child_time
+        push_i32_const(entry);
+        push_i32_const(entry);
+        push_memory(instr_f64_load, 3, 0);
+        push_local(instr_get_local, elapsed);
+        binary.push_back(instr_f64_add);
+        push_i32_const(table);
+        push_memory(instr_f64_load, 3, 8);
+        binary.push_back(instr_f64_sub);
+        push_memory(instr_f64_store, 3, 0);
+        // total_time += elapsed
+        push_i32_const(entry);
+        push_i32_const(entry);
+        push_memory(instr_f64_load, 3, 8);
+        push_local(instr_get_local, elapsed);
+        binary.push_back(instr_f64_add);
+        push_memory(instr_f64_store, 3, 8);
+        // child_time = saved_child + elapsed, for the caller
+        push_i32_const(table);
+        push_local(instr_get_local, saved_child);
+        push_local(instr_get_local, elapsed);
+        binary.push_back(instr_f64_add);
+        push_memory(instr_f64_store, 3, 8);
+    }
+    binary.push_back(instr_end);
+} // push_instrumented_body
+
+void push_instrumented_code(Linked& linked) {
+    auto& binary = linked.binary;
+    binary.push_back(sec_code);
+    push_sized_counted(binary, [&] {
+        uint32_t count{};
+        for (auto& module : linked.modules) {
+            if (!module->is_marked)
+                continue;
+            for_each_body(*module, [&](uint32_t i, size_t pos, size_t end) {
+                auto& function = module->functions[i];
+                if (function.is_discarded)
+                    return;
+                auto& type = linked.function_types
+                    [module->replacement_function_types[function.type]];
+                try {
+                    push_sized(binary, [&] {
+                        push_instrumented_body(
+                            linked, *module, type, pos, end,
+                            linked.profile_offset + profile_header_size +
+                                count * profile_entry_size);
+                    });
+                } catch (std::exception& e) {
+                    throw std::runtime_error(
+                        module->filename + ": can't instrument function " +
+                        std::to_string(i) + ": " + e.what());
+                }
+                ++count;
+            });
+        }
+        return count;
+    });
+}
+
 void push_sec_code(Linked& linked) {
+    if (linked.instrument)
+        return push_instrumented_code(linked);
     auto& binary = linked.binary;
     binary.push_back(sec_code);
     push_sized_counted(binary, [&] {
@@ -1258,12 +2196,31 @@ void push_sec_code(Linked& linked) {
         for (auto& module : linked.modules) {
             if (!module->is_marked || !module->sections[sec_code].valid)
                 continue;
-            auto& sec = module->sections[sec_code];
-            auto pos = sec.begin;
-            auto c = read_leb(module->binary, pos);
-            binary.insert(binary.end(), module->binary.begin() + pos,
-                          module->binary.begin() + sec.end);
-            count += c;
+            auto has_discarded =
+                std::any_of(module->functions.begin(), module->functions.end(),
+                            [](auto& f) { return f.is_discarded; });
+            if (!has_discarded) {
+                auto& sec = module->sections[sec_code];
+                auto pos = sec.begin;
+                auto c = read_leb(module->binary, pos);
+                binary.insert(binary.end(), module->binary.begin() + pos,
+                              module->binary.begin() + sec.end);
+                count += c;
+                continue;
+            }
+            for (auto i = module->num_imported_functions;
+                 i < module->functions.size(); ++i) {
+                auto& function = module->functions[i];
+                if (function.is_discarded)
+                    continue;
+                push_sized(binary, [&] {
+                    binary.insert(
+                        binary.end(),
+                        module->binary.begin() + function.body_begin,
+                        module->binary.begin() + function.body_end);
+                });
+                ++count;
+            }
         }
         return count;
     });
@@ -1299,9 +2256,11 @@ void push_sec_data(Linked& linked) {
             if (!module->is_marked)
                 continue;
             for (auto& data_segment : module->data_segments) {
+                if (data_segment.is_merged || data_segment.is_discarded)
+                    continue;
                 binary.push_back(0); // index
-                push_init_expr32(binary,
-                                 data_segment.offset + module->memory_offset);
+                push_init_expr32(
+                    binary, translate_address(*module, data_segment.offset, 0));
                 push_leb5(binary, data_segment.size);
                 binary.insert(binary.end(),
                               module->binary.begin() + data_segment.data_begin,
@@ -1310,10 +2269,80 @@ void push_sec_data(Linked& linked) {
                 ++count;
             }
         }
+        for (auto& merged : linked.merged_data) {
+            binary.push_back(0); // index
+            push_init_expr32(binary, merged.final_address);
+            push_leb5(binary, merged.size);
+            binary.insert(binary.end(),
+                          merged.module->binary.begin() + merged.data_begin,
+                          merged.module->binary.begin() + merged.data_begin +
+                              merged.size);
+            ++count;
+        }
+        if (linked.instrument) {
+            binary.push_back(0); // index
+            push_init_expr32(binary, linked.profile_offset);
+            push_leb5(binary, 8);
+            auto pos = binary.size();
+            binary.resize(pos + 8);
+            write_i32(binary, pos, linked.num_profiled_functions);
+            write_i32(binary, pos + 4,
+                      linked.instrument_time ? profile_flag_time : 0);
+            ++count;
+        }
         return count;
     });
 }
 
+// Function names for profilers and debuggers. Imports use their import
+// names; definitions use the input's name section when it has one, then
+// their export symbol.
+void push_sec_name(Linked& linked) {
+    auto& binary = linked.binary;
+    binary.push_back(sec_custom);
+    push_sized(binary, [&] {
+        push_str(binary, "name");
+        binary.push_back(name_function);
+        push_sized(binary, [&] {
+            push_counted(binary, [&] {
+                uint32_t index{};
+                for (auto& linked_symbol : linked.unresolved_functions) {
+                    if (!linked_symbol->is_marked)
+                        continue;
+                    auto symbol = linked_symbol->symbols[0];
+                    push_leb5(binary, index++);
+                    push_str(binary,
+                             symbol->module->imports[*symbol->import_index]
+                                 .name);
+                }
+                for (auto& module : linked.modules) {
+                    if (!module->is_marked)
+                        continue;
+                    for (auto i = module->num_imported_functions;
+                         i < module->functions.size(); ++i) {
+                        auto& function = module->functions[i];
+                        if (function.is_discarded)
+                            continue;
+                        std::string name;
+                        if (i < module->function_names.size() &&
+                            !module->function_names[i].empty())
+                            name = module->function_names[i];
+                        else if (function.export_symbol)
+                            name = module->exports
+                                       [*function.export_symbol->export_index]
+                                           .name;
+                        else
+                            name = module->filename + "#" + std::to_string(i);
+                        push_leb5(binary, index++);
+                        push_str(binary, name);
+                    }
+                }
+                return index;
+            });
+        });
+    });
+}
+
 // Here's where I cheat. This linker's output isn't
 // relocatable, but it has a linking section, contrary to
 // https://github.com/WebAssembly/tool-conventions/blob/master/Linking.md
@@ -1354,13 +2383,21 @@ void push_sec_linking(Linked& linked) {
 }
 
 void link(Linked& linked, uint32_t memory_offset, uint32_t element_offset) {
+    create_dyncall_thunks(linked);
+    if (linked.instrument)
+        create_profile_function(linked);
     link_symbols(linked);
     mark_all(linked);
     map_function_types(linked);
     allocate_memory(linked, memory_offset);
+    allocate_profile(linked);
     allocate_functions(linked);
+    if (linked.instrument)
+        fill_profile_function_code(linked, *linked.profile_module);
     allocate_code(linked);
     allocate_globals(linked);
+    if (linked.devirtualize || linked.drop_unused_elements)
+        devirtualize(linked);
     allocate_elements(linked, element_offset);
     relocate(linked);
     fill_header(linked);
@@ -1373,36 +2410,60 @@ void link(Linked& linked, uint32_t memory_offset, uint32_t element_offset) {
     push_sec_code(linked);
     push_sec_code_reloc(linked);
     push_sec_data(linked);
+    if (linked.instrument)
+        push_sec_name(linked);
     push_sec_linking(linked);
 }
 
 void linkEos(Linked& linked, Module& main_module, uint32_t stack_size) {
+    linkEos(linked, std::vector<Module*>{&main_module}, stack_size);
+}
+
+void linkEos(Linked& linked, const std::vector<Module*>& main_modules,
+             uint32_t stack_size) {
     auto* sp = create_sp_export(linked);
     auto& start_module = create_start_function(linked);
+    if (linked.instrument)
+        create_profile_function(linked);
     link_symbols(linked);
 
     std::vector<LinkedSymbol*> queue;
-    mark_module(linked, main_module, queue);
+    for (auto* main_module : main_modules)
+        mark_module(linked, *main_module, queue);
     mark_module(linked, start_module, queue);
     add_export_to_queue(linked, "init", queue);
     add_export_to_queue(linked, "apply", queue);
+    if (linked.instrument)
+        add_export_to_queue(linked, profile_function_name, queue);
     mark_symbols_in_queue(linked, queue);
 
     map_function_types(linked);
     allocate_memory(linked, 16);
+    allocate_profile(linked);
+    allocate_functions(linked);
+    auto need_start = fill_start_function_code(linked, start_module);
+    if (linked.instrument)
+        fill_profile_function_code(linked, *linked.profile_module);
+    allocate_code(linked);
+    allocate_globals(linked);
+    if (linked.devirtualize || linked.drop_unused_elements)
+        devirtualize(linked);
+    allocate_elements(linked, 1);
+    relocate(linked);
 
+    // The stack sits above everything else, so nothing before this
+    // depends on its size
     if (sp->linked_symbol->is_marked) {
+        if (linked.auto_stack_size) {
+            compute_stack_bound(linked, *sp->linked_symbol->final_index);
+            if (linked.stack_bound)
+                stack_size = align(*linked.stack_bound, memory_alignment);
+        }
         linked.memory_size += stack_size;
         sp->module->globals[*sp->export_global_index].init_u32 =
             linked.memory_size;
     }
 
-    allocate_functions(linked);
-    auto need_start = fill_start_function_code(linked, start_module);
-    allocate_code(linked);
-    allocate_globals(linked);
-    allocate_elements(linked, 1);
-    relocate(linked);
     fill_header(linked);
     push_sec_type(linked);
     push_sec_import(linked, true, false);
@@ -1416,6 +2477,8 @@ void linkEos(Linked& linked, Module& main_module, uint32_t stack_size) {
     push_sec_elem(linked);
     push_sec_code(linked);
     push_sec_data(linked);
+    if (linked.instrument)
+        push_sec_name(linked);
 }
 
 } // namespace WasmTools
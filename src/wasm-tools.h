@@ -18,6 +18,7 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
 // DEALINGS IN THE SOFTWARE.
 
+#include <deque>
 #include <map>
 #include <memory>
 #include <optional>
@@ -40,6 +41,14 @@ inline const char* const stack_pointer_name = "__stack_pointer";
 inline const char* const start_function_name = "__start_function";
 inline const char* const memory_name = "__linear_memory";
 inline const char* const table_name = "__indirect_function_table";
+inline const char* const profile_function_name = "__cib_profile";
+inline const char* const clock_function_name = "__cib_clock";
+
+// Profile table: header {u32 num_functions, u32 flags, f64 child_time},
+// then per defined function {f64 self_time, f64 total_time, u32 calls, pad}
+inline const uint32_t profile_header_size = 16;
+inline const uint32_t profile_entry_size = 24;
+inline const uint32_t profile_flag_time = 1;
 
 // emscripten's SP lives at 1024
 inline const uint32_t default_memory_offset = 1024 + 16;
@@ -87,6 +96,12 @@ inline const uint8_t link_symbol_info = 0x2;
 inline const uint8_t link_data_size = 0x3;
 inline const uint8_t link_segment_info = 0x5;
 inline const uint8_t link_init_funcs = 0x6;
+inline const uint8_t link_comdat_info = 0x7;
+
+inline const uint8_t comdat_data = 0x0;
+inline const uint8_t comdat_function = 0x1;
+
+inline const uint8_t seg_flag_strings = 0x1;
 
 inline const uint8_t sym_binding_weak = 1;
 inline const uint8_t sym_binding_local = 2;
@@ -96,9 +111,29 @@ inline const uint8_t name_module = 0;
 inline const uint8_t name_function = 1;
 inline const uint8_t name_local = 2;
 
+inline const uint8_t instr_block = 0x02;
+inline const uint8_t instr_loop = 0x03;
+inline const uint8_t instr_if = 0x04;
 inline const uint8_t instr_end = 0x0b;
+inline const uint8_t instr_br = 0x0c;
+inline const uint8_t instr_return = 0x0f;
 inline const uint8_t instr_call = 0x10;
+inline const uint8_t instr_call_indirect = 0x11;
+inline const uint8_t instr_drop = 0x1a;
+inline const uint8_t instr_get_local = 0x20;
+inline const uint8_t instr_set_local = 0x21;
+inline const uint8_t instr_get_global = 0x23;
+inline const uint8_t instr_set_global = 0x24;
+inline const uint8_t instr_i32_load = 0x28;
+inline const uint8_t instr_f64_load = 0x2b;
+inline const uint8_t instr_i32_store = 0x36;
+inline const uint8_t instr_f64_store = 0x39;
 inline const uint8_t instr_i32_const = 0x41;
+inline const uint8_t instr_f64_const = 0x44;
+inline const uint8_t instr_i32_add = 0x6a;
+inline const uint8_t instr_i32_sub = 0x6b;
+inline const uint8_t instr_f64_add = 0xa0;
+inline const uint8_t instr_f64_sub = 0xa1;
 
 const char* type_str(uint8_t type);
 
@@ -172,6 +207,10 @@ inline bool operator<(const FunctionType& a, const FunctionType& b) {
 struct Function {
     uint32_t type{};
     struct Symbol* import_symbol{};
+    struct Symbol* export_symbol{};
+    uint32_t body_begin{};
+    uint32_t body_end{};
+    bool is_discarded{};
 };
 
 struct ResizableLimits {
@@ -185,8 +224,10 @@ struct Global {
     uint8_t mutability{};
     uint32_t init_u32{};
     struct Symbol* import_symbol{};
+    struct Symbol* export_symbol{};
     bool has_symbols{};
     bool is_memory_address{true};
+    bool is_discarded{};
 };
 
 struct Export {
@@ -204,6 +245,26 @@ struct DataSegment {
     uint32_t offset;
     uint32_t size;
     uint32_t data_begin;
+    std::string_view name{};
+    uint32_t alignment{}; // log2
+    uint32_t flags{};
+    bool is_merged{};
+    bool is_discarded{};
+};
+
+// A range of a module's data and where it ended up in linear memory
+struct DataPiece {
+    uint32_t offset{};
+    uint32_t size{};
+    uint32_t final_address{};
+};
+
+// A single surviving copy of mergeable data
+struct MergedData {
+    struct Module* module{};
+    uint32_t data_begin{};
+    uint32_t size{};
+    uint32_t final_address{};
 };
 
 struct Reloc {
@@ -214,6 +275,12 @@ struct Reloc {
     uint32_t addend{};
 };
 
+struct Comdat {
+    std::string_view name{};
+    std::vector<uint32_t> functions{};
+    std::vector<uint32_t> data_segments{};
+};
+
 struct InitFunction {
     uint32_t priority{};
     uint32_t index{};
@@ -247,6 +314,8 @@ struct Module {
     std::vector<Export> exports{};
     std::vector<Element> elements{};
     std::vector<DataSegment> data_segments{};
+    std::vector<DataPiece> data_pieces{};
+    bool has_segment_info{};
     std::vector<Reloc> relocs{};
     std::map<std::string_view, Symbol> symbols{};
     uint32_t data_size{};
@@ -254,9 +323,13 @@ struct Module {
     uint32_t code_offset{};
     uint32_t function_offset{};
     std::vector<InitFunction> init_functions{};
+    std::vector<Comdat> comdats{};
+    std::vector<std::string_view> function_names{};
+    std::deque<std::string> synthetic_names{}; // stable storage for names
     std::vector<uint32_t> replacement_function_types{};
     std::vector<std::optional<uint32_t>> replacement_globals{};
     std::vector<std::optional<uint32_t>> replacement_addresses{};
+    std::vector<std::tuple<Module*, uint32_t>> original_addresses{};
     std::vector<uint32_t> replacement_functions{};
     std::vector<uint32_t> replacement_elements{};
     bool is_marked{};
@@ -285,17 +358,49 @@ struct Linked {
     std::vector<LinkedSymbol*> export_functions{};
     std::vector<LinkedSymbol*> export_globals{};
     uint32_t memory_size{};
+    std::vector<MergedData> merged_data{};
+    std::map<std::string_view, Module*> comdat_owners{};
     uint32_t element_offset{};
     std::vector<uint32_t> elements{};
     std::map<uint32_t, uint32_t> function_element_map{};
     std::vector<Reloc> code_relocs{};
+
+    // Whole-program only. devirtualize turns call_indirect into call when
+    // its type has a single table entry; drop_unused_elements leaves out of
+    // the table the functions which no remaining call_indirect can reach.
+    bool devirtualize{};
+    bool drop_unused_elements{};
+    std::map<uint32_t, uint32_t> indirect_call_counts{};
+
+    // With auto_stack_size, linkEos sizes the stack from the call graph and
+    // only uses its stack_size argument when there is no bound
+    bool auto_stack_size{};
+    std::optional<uint32_t> stack_bound{};
+    bool has_recursion{};
+    bool has_dynamic_frames{};
+    bool has_indirect_calls{};
+
+    // Set these before linking to count calls (and optionally time them)
+    // into a table exported through profile_function_name
+    bool instrument{};
+    bool instrument_time{};
+    Module* profile_module{};
+    uint32_t profile_offset{};
+    uint32_t num_profiled_functions{};
 };
 
 void read_module(Module& module);
 
+// Copies a module which read_module() filled in but which hasn't been linked,
+// for linking it more than once. Linking changes the copy's binary, but its
+// names still point into source's, so source must outlive it unchanged.
+std::unique_ptr<Module> clone_module(const Module& source);
+
 void link(Linked& linked, uint32_t memory_offset = default_memory_offset,
           uint32_t element_offset = default_element_offset);
 
 void linkEos(Linked& linked, Module& main_module, uint32_t stack_size);
+void linkEos(Linked& linked, const std::vector<Module*>& main_modules,
+             uint32_t stack_size);
 
 } // namespace WasmTools
@@ -66,6 +66,13 @@ const WASM_DATA_SIZE = 0x3;
 const WASM_SEGMENT_INFO = 0x5;
 const WASM_INIT_FUNCS = 0x6;
 
+const WASM_NAMES_FUNCTION = 0x1;
+
+// Profile table written by cib-link --instrument; see wasm-tools.h
+const PROFILE_HEADER_SIZE = 16;
+const PROFILE_ENTRY_SIZE = 24;
+const PROFILE_FLAG_TIME = 1;
+
 const EXTERNAL_FUNCTION = 0;
 const EXTERNAL_TABLE = 1;
 const EXTERNAL_MEMORY = 2;
@@ -79,15 +86,26 @@ const TYPE_ANYFUNC = 0x70;
 const TYPE_FUNC = 0x60;
 const TYPE_BLOCK = 0x40;
 
+const INSTR_BLOCK = 0x02;
+const INSTR_LOOP = 0x03;
+const INSTR_IF = 0x04;
 const INSTR_END = 0x0b;
+const INSTR_BR = 0x0c;
+const INSTR_RETURN = 0x0f;
 const INSTR_CALL = 0x10;
 const INSTR_GET_LOCAL = 0x20;
 const INSTR_SET_LOCAL = 0x21;
 const INSTR_GET_GLOBAL = 0x23;
 const INSTR_SET_GLOBAL = 0x24;
 const INSTR_I32_LOAD = 0x28;
+const INSTR_F64_LOAD = 0x2b;
 const INSTR_I32_STORE = 0x36;
+const INSTR_F64_STORE = 0x39;
 const INSTR_I32_CONST = 0x41;
+const INSTR_F64_CONST = 0x44;
+const INSTR_I32_ADD = 0x6a;
+const INSTR_F64_ADD = 0xa0;
+const INSTR_F64_SUB = 0xa1;
 
 function check(bool, msg) {
     if (!bool)
@@ -410,6 +428,24 @@ function skipInstr(binary, opcode, pos) {
             break;
         }
 
+        // Sign extension
+        case 0xc0:
+        case 0xc1:
+        case 0xc2:
+        case 0xc3:
+        case 0xc4:
+            break;
+
+        // Saturating truncation, bulk memory and table ops
+        case 0xfc: {
+            let op = readLeb(binary, pos);
+            let immediates = op <= 0x07 ? 0 : op === 0x08 || op === 0x0a || op === 0x0c || op === 0x0e ? 2 : 1;
+            check(op <= 0x11, 'unsupported opcode: fc ' + op.toString(16));
+            for (let i = 0; i < immediates; ++i)
+                readLeb(binary, pos);
+            break;
+        }
+
         default:
             check(false, 'unrecognized opcode: ' + opcode.toString(16))
     } // switch (opcode)
@@ -454,6 +490,7 @@ function getSegments(binary) {
     let standardSections = {};
     let relocs = [];
     let linking;
+    let names;
     while (pos.byte < end) {
         let begin = pos.byte;
         let id = binary[pos.byte++];
@@ -466,6 +503,8 @@ function getSegments(binary) {
             let sec = { name, byte: pos.byte, end: sEnd };
             if (name === 'linking')
                 linking = sec;
+            else if (name === 'name')
+                names = sec;
             else if (name.substr(0, 6) === 'reloc.')
                 relocs.push(sec);
         }
@@ -475,9 +514,10 @@ function getSegments(binary) {
         console.log('standardSections:', standardSections);
         console.log('relocs:', relocs);
         console.log('linking:', linking);
+        console.log('names:', names);
     }
 
-    return { standardSections, relocs, linking };
+    return { standardSections, relocs, linking, names };
 }
 
 function getCount(binary, section) {
@@ -724,6 +764,27 @@ function getLinkingInfo(binary, linking) {
     return { dataSize, initFunctions };
 } // getLinkingInfo
 
+function getFunctionNames(binary, names) {
+    let functionNames = [];
+    if (!names)
+        return functionNames;
+    let pos = { byte: names.byte };
+    while (pos.byte < names.end) {
+        let type = binary[pos.byte++];
+        let pLen = readLeb(binary, pos);
+        let pEnd = pos.byte + pLen;
+        if (type === WASM_NAMES_FUNCTION) {
+            let count = readLeb(binary, pos);
+            for (let i = 0; i < count; ++i) {
+                let index = readLeb(binary, pos);
+                functionNames[index] = getStr(binary, pos);
+            }
+        }
+        pos.byte = pEnd;
+    }
+    return functionNames;
+} // getFunctionNames
+
 function relocate(binary, standardSections, relocs, outsideExports, globalImports, memoryBase, tableBase) {
     for (let reloc of relocs) {
         if (logReloc)
@@ -847,6 +908,151 @@ function generateNewBodies(binary, types, functions, bodies, spGlobalIndex) {
     } // for (let body of bodies)
 } // generateNewBodies()
 
+// The user-module side of cib-link --instrument; see push_instrumented_body()
+// in wasm-tools.cpp. Wraps each body.newCode from generateNewBodies() with
+// code which updates its entry in entries, laid out like the rtl's profile
+// table. With timing, bodies share the rtl table's child-time slot, so self
+// time stays right across calls between the rtl and user code, and read the
+// clock through function clockIndex; calls to functions at or above it move
+// up by one to make room for that import.
+function instrumentBodies(types, functions, bodies, table, entries, timed, clockIndex) {
+    for (let i = 0; i < functions.length; ++i) {
+        let functionType = types[functions[i]];
+        let body = bodies[i];
+        let code = body.newCode;
+        let entry = entries + i * PROFILE_ENTRY_SIZE;
+        let numLocals = functionType.argTypes.length;
+        for (let local of body.locals)
+            numLocals += local.count;
+        let elapsed = numLocals;
+        let savedChild = numLocals + 1;
+        if (timed)
+            body.locals.push({ count: 2, type: TYPE_F64 });
+
+        let newCode = [];
+        let pushI32Const = value => {
+            newCode.push(INSTR_I32_CONST);
+            pushLeb5(newCode, value);
+        };
+        let pushMemory = (opcode, align, offset) => {
+            newCode.push(opcode);
+            pushLeb5(newCode, align);
+            pushLeb5(newCode, offset);
+        };
+        let pushLocal = (opcode, index) => {
+            newCode.push(opcode);
+            pushLeb5(newCode, index);
+        };
+        let pushClock = () => {
+            newCode.push(INSTR_CALL);
+            pushLeb5(newCode, clockIndex);
+        };
+
+        // ++calls
+        pushI32Const(entry);
+        pushI32Const(entry);
+        pushMemory(INSTR_I32_LOAD, 2, 16);
+        pushI32Const(1);
+        newCode.push(INSTR_I32_ADD);
+        pushMemory(INSTR_I32_STORE, 2, 16);
+        if (timed) {
+            // savedChild = childTime; childTime = 0; elapsed = clock()
+            pushI32Const(table);
+            pushMemory(INSTR_F64_LOAD, 3, 8);
+            pushLocal(INSTR_SET_LOCAL, savedChild);
+            pushI32Const(table);
+            newCode.push(INSTR_F64_CONST, 0, 0, 0, 0, 0, 0, 0, 0);
+            pushMemory(INSTR_F64_STORE, 3, 8);
+            pushClock();
+            pushLocal(INSTR_SET_LOCAL, elapsed);
+        }
+
+        // The original body runs inside a block so returns become branches
+        // to the exit code
+        newCode.push(INSTR_BLOCK, functionType.returnTypes.length ? functionType.returnTypes[0] : TYPE_BLOCK);
+        let pos = { byte: 0 };
+        let depth = 0;
+        while (true) {
+            check(pos.byte < code.length, 'function body missing end');
+            let instrBegin = pos.byte;
+            let opcode = code[pos.byte++];
+            if (opcode === INSTR_END && !depth) {
+                check(pos.byte === code.length, 'function body has data after end');
+                break;
+            }
+            if (opcode === INSTR_RETURN) {
+                newCode.push(INSTR_BR);
+                pushLeb5(newCode, depth);
+                continue;
+            }
+            if (opcode === INSTR_CALL && timed) {
+                let index = readLeb(code, pos);
+                newCode.push(INSTR_CALL);
+                pushLeb5(newCode, index >= clockIndex ? index + 1 : index);
+                continue;
+            }
+            if (opcode === INSTR_BLOCK || opcode === INSTR_LOOP || opcode === INSTR_IF)
+                ++depth;
+            else if (opcode === INSTR_END)
+                --depth;
+            skipInstr(code, opcode, pos);
+            for (let j = instrBegin; j < pos.byte; ++j)
+                newCode.push(code[j]);
+        }
+        newCode.push(INSTR_END);
+
+        if (timed) {
+            // elapsed = clock() - start
+            pushClock();
+            pushLocal(INSTR_GET_LOCAL, elapsed);
+            newCode.push(INSTR_F64_SUB);
+            pushLocal(INSTR_SET_LOCAL, elapsed);
+            // selfTime += elapsed - childTime
+            pushI32Const(entry);
+            pushI32Const(entry);
+            pushMemory(INSTR_F64_LOAD, 3, 0);
+            pushLocal(INSTR_GET_LOCAL, elapsed);
+            newCode.push(INSTR_F64_ADD);
+            pushI32Const(table);
+            pushMemory(INSTR_F64_LOAD, 3, 8);
+            newCode.push(INSTR_F64_SUB);
+            pushMemory(INSTR_F64_STORE, 3, 0);
+            // totalTime += elapsed
+            pushI32Const(entry);
+            pushI32Const(entry);
+            pushMemory(INSTR_F64_LOAD, 3, 8);
+            pushLocal(INSTR_GET_LOCAL, elapsed);
+            newCode.push(INSTR_F64_ADD);
+            pushMemory(INSTR_F64_STORE, 3, 8);
+            // childTime = savedChild + elapsed, for the caller
+            pushI32Const(table);
+            pushLocal(INSTR_GET_LOCAL, savedChild);
+            pushLocal(INSTR_GET_LOCAL, elapsed);
+            newCode.push(INSTR_F64_ADD);
+            pushMemory(INSTR_F64_STORE, 3, 8);
+        }
+        newCode.push(INSTR_END);
+        body.newCode = newCode;
+    }
+} // instrumentBodies()
+
+// The import section with a function import appended; its index is the old
+// number of function imports
+function generateImportWith(binary, section, fieldStr, typeIndex) {
+    let result = [];
+    let pos = { byte: section ? section.byte : 0 };
+    let count = section ? readLeb(binary, pos) : 0;
+    pushLeb5(result, count + 1);
+    if (section)
+        for (let i = pos.byte; i < section.end; ++i)
+            result.push(binary[i]);
+    pushStr(result, 'env');
+    pushStr(result, fieldStr);
+    result.push(EXTERNAL_FUNCTION);
+    pushLeb5(result, typeIndex);
+    return result;
+}
+
 function generateInit(name, types, numFunctionImports, functions, exports, bodies, initFunctions) {
     exports[name] = { kind: EXTERNAL_FUNCTION, index: numFunctionImports + functions.length };
     functions.push(types.length);